@@ -22,6 +22,7 @@
 #include "const.h"
 #include "aabb.h"
 #include "mesh.h"
+#include <glm/common.hpp>
 
 aabb::aabb(const Mesh& m)
 {
@@ -68,3 +69,70 @@ aabb::aabb(const MeshInstance& o)
         }
     }
 }
+
+aabb aabb::empty()
+{
+    aabb box;
+    box.min = VEC3_MAXIMUM;
+    box.max = VEC3_MINIMUM;
+    return box;
+}
+
+void aabb::extend(const vec3& p)
+{
+    for (int c = 0; c < 3; ++c) {
+        if (p[c] < this->min[c]) {
+            this->min[c] = p[c];
+        }
+        if (p[c] > this->max[c]) {
+            this->max[c] = p[c];
+        }
+    }
+}
+
+void aabb::extend(const aabb& b)
+{
+    for (int c = 0; c < 3; ++c) {
+        if (b.min[c] < this->min[c]) {
+            this->min[c] = b.min[c];
+        }
+        if (b.max[c] > this->max[c]) {
+            this->max[c] = b.max[c];
+        }
+    }
+}
+
+scalar aabb::surface_area() const
+{
+    vec3 d = this->max - this->min;
+    if (d.x < 0 || d.y < 0 || d.z < 0) {
+        return 0;
+    }
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+/**
+ * Spread the low 21 bits of a value out, so there are two zero bits between each of them.
+ */
+static inline uint64_t expand_morton_bits(uint64_t v)
+{
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+uint64_t aabb::morton_code(const vec3& p) const
+{
+    uint64_t code = 0;
+    for (int c = 0; c < 3; ++c) {
+        scalar extent = this->max[c] - this->min[c];
+        scalar t = extent > 0 ? (p[c] - this->min[c]) / extent : 0;
+        uint64_t q = (uint64_t)glm::clamp(t * (scalar)0x1fffff, (scalar)0, (scalar)0x1fffff);
+        code |= expand_morton_bits(q) << (2 - c);
+    }
+    return code;
+}
@@ -22,7 +22,11 @@
 #pragma once
 
 #include "types.h"
+#include "const.h"
 #include <glm/vec3.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 
 class Mesh;
 class MeshInstance;
@@ -42,21 +46,66 @@ struct aabb {
      */
     aabb(const MeshInstance& o);
 
-    vec3& operator[](size_t i)
-    {
-        if (i == 0) {
-            return min;
-        } else {
-            return max;
-        }
-    }
+    /**
+     * Construct an empty AABB, which contains no points. Extending it by any point or volume
+     * yields a valid AABB.
+     */
+    static aabb empty();
+
+    /**
+     * Grow the AABB to contain a point.
+     */
+    void extend(const vec3& p);
+
+    /**
+     * Grow the AABB to contain another AABB.
+     */
+    void extend(const aabb& b);
+
+    /**
+     * Get the center point of the AABB.
+     */
+    vec3 centroid() const { return (min + max) * (scalar)0.5; }
+
+    /**
+     * Compute the surface area of the AABB. Empty AABBs have no area.
+     */
+    scalar surface_area() const;
+
+    /**
+     * Compute the 63 bit Morton code of a point, relative to the AABB. Points outside are clamped
+     * to its faces.
+     */
+    uint64_t morton_code(const vec3& p) const;
 
-    const vec3& operator[](size_t i) const
+    /**
+     * Slab test against a ray, without branches. The near and far plane on each axis are picked by
+     * the sign of the ray direction, rather than sorted after computing both distances.
+     *
+     * @param origin Origin of the ray.
+     * @param inv_dir Reciprocal of the ray direction. Must be finite.
+     * @param sign For each axis, 1 if the ray direction is negative, else 0.
+     * @param tmin Start of the interval along the ray to test.
+     * @param tmax End of the interval along the ray to test.
+     * @param tnear Receives the distance the ray enters the AABB, no closer than tmin.
+     * @return True if the ray passes through the AABB within the interval.
+     */
+    bool intersect(const vec3& origin, const vec3& inv_dir, const int *sign, scalar tmin,
+                   scalar tmax, scalar& tnear) const
     {
-        if (i == 0) {
-            return min;
-        } else {
-            return max;
+        scalar tfar = tmax;
+        tnear = tmin;
+        for (int c = 0; c < 3; ++c) {
+            // Distances are computed from the planes directly, so neighboring boxes agree on
+            // shared planes
+            tnear = std::max(tnear, ((*this)[sign[c]][c] - origin[c]) * inv_dir[c]);
+            tfar = std::min(tfar, ((*this)[1 - sign[c]][c] - origin[c]) * inv_dir[c]);
         }
+        return tnear <= tfar * SLAB_FAR_SCALE;
     }
+
+    // Compiles to a select rather than a branch
+    vec3& operator[](size_t i) { return i ? max : min; }
+
+    const vec3& operator[](size_t i) const { return i ? max : min; }
 };
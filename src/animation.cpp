@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2018 Matt Monsour
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "animation.h"
+#include "convert.h"
+#include <algorithm>
+
+/** Tick rate assumed for animations which don't specify one */
+const static double DEFAULT_TICKS_PER_SECOND = 25.0;
+
+SceneAnimation::SceneAnimation(const aiAnimation& animation) :
+    m_animation(&animation),
+    m_ticks_per_second(animation.mTicksPerSecond > 0 ? animation.mTicksPerSecond
+            : DEFAULT_TICKS_PER_SECOND)
+{
+    for (unsigned int i = 0; i < animation.mNumChannels; ++i) {
+        const aiNodeAnim *channel = animation.mChannels[i];
+        m_channels[channel->mNodeName.C_Str()] = channel;
+    }
+}
+
+/**
+ * Find the pair of keys surrounding a point in time.
+ *
+ * @param t Set to the position of time between the two keys, from [0,1].
+ * @return Index of the key at or before time. The following key is used for interpolation, unless
+ * it is the last key.
+ */
+template <typename Key>
+static unsigned int find_key(const Key *keys, unsigned int count, double time, double& t)
+{
+    auto next = std::upper_bound(keys, keys + count, time, [](double time, const Key& key) {
+            return time < key.mTime;
+        });
+    if (next == keys) {
+        t = 0;
+        return 0;
+    }
+    if (next == keys + count) {
+        t = 0;
+        return count - 1;
+    }
+    auto prev = next - 1;
+    double span = next->mTime - prev->mTime;
+    t = span > 0 ? (time - prev->mTime) / span : 0;
+    return prev - keys;
+}
+
+/**
+ * Interpolate linearly between vector keys.
+ */
+static aiVector3D interpolate_keys(const aiVectorKey *keys, unsigned int count, double time)
+{
+    double t;
+    unsigned int k = find_key(keys, count, time, t);
+    const aiVector3D& a = keys[k].mValue;
+    if (t == 0) {
+        return a;
+    }
+    const aiVector3D& b = keys[k + 1].mValue;
+    return aiVector3D(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+}
+
+/**
+ * Interpolate spherically between rotation keys.
+ */
+static aiQuaternion interpolate_keys(const aiQuatKey *keys, unsigned int count, double time)
+{
+    double t;
+    unsigned int k = find_key(keys, count, time, t);
+    if (t == 0) {
+        return keys[k].mValue;
+    }
+    aiQuaternion out;
+    aiQuaternion::Interpolate(out, keys[k].mValue, keys[k + 1].mValue, t);
+    return out.Normalize();
+}
+
+mat4 SceneAnimation::node_transform(const aiNode& node, double time) const
+{
+    auto it = m_channels.find(node.mName.C_Str());
+    if (it == m_channels.end()) {
+        return assimp_mat_to_glm(node.mTransformation);
+    }
+    const aiNodeAnim& channel = *it->second;
+    double ticks = std::min(std::max(time * m_ticks_per_second, 0.0), m_animation->mDuration);
+    aiVector3D position(0, 0, 0), scaling(1, 1, 1);
+    aiQuaternion rotation;
+    if (channel.mNumPositionKeys > 0) {
+        position = interpolate_keys(channel.mPositionKeys, channel.mNumPositionKeys, ticks);
+    }
+    if (channel.mNumRotationKeys > 0) {
+        rotation = interpolate_keys(channel.mRotationKeys, channel.mNumRotationKeys, ticks);
+    }
+    if (channel.mNumScalingKeys > 0) {
+        scaling = interpolate_keys(channel.mScalingKeys, channel.mNumScalingKeys, ticks);
+    }
+    return assimp_mat_to_glm(aiMatrix4x4(scaling, rotation, position));
+}
@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2018 Matt Monsour
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "types.h"
+#include <assimp/scene.h>
+#include <assimp/anim.h>
+#include <string>
+#include <unordered_map>
+
+/**
+ * Node animation from an assimp scene, evaluated at arbitrary points in time. Only node transforms
+ * are animated, so the meshes of the scene stay unchanged.
+ */
+class SceneAnimation {
+    private:
+
+        const aiAnimation *m_animation;
+        std::unordered_map<std::string, const aiNodeAnim*> m_channels; // Keyed by node name
+        double m_ticks_per_second;
+
+    public:
+
+        /**
+         * Construct from an animation in an assimp scene. The animation must outlive this object.
+         */
+        SceneAnimation(const aiAnimation& animation);
+
+        /**
+         * Get the name of the animation.
+         */
+        std::string name() const { return m_animation->mName.C_Str(); }
+
+        /**
+         * Get the length of the animation in seconds.
+         */
+        double duration() const { return m_animation->mDuration / m_ticks_per_second; }
+
+        /**
+         * Compute the transform of a node relative to its parent at a point in the animation.
+         * Nodes without an animation channel keep their static transform.
+         *
+         * @param time Time in seconds from the start of the animation. Clamped to its duration.
+         */
+        mat4 node_transform(const aiNode& node, double time) const;
+};
@@ -23,27 +23,113 @@
 #include "convert.h"
 #include "bvh.h"
 #include "trace.h"
+#include "animation.h"
+#include "scheduler.h"
 #include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <chrono>
+#include <queue>
+#include <stdexcept>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include <iostream>
+#include <iomanip>
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/string_cast.hpp>
+#include <glm/common.hpp>
+#include <glm/geometric.hpp>
+
+/** Partitions with fewer primitives than this are always built on the calling thread */
+const static size_t PARALLEL_BUILD_THRESHOLD = 4096;
+
+/** Number of instances handled at once when computing instance bounds in parallel */
+const static size_t INSTANCE_BOUNDS_GRAIN = 1024;
+
+/** Marks a missing node in the parent and leaf links of an edited tree */
+const static uint32_t NO_NODE = UINT32_MAX;
+
+/** Largest number of leaves in a treelet restructured by treelet optimization */
+const static size_t TREELET_LEAVES = 7;
+
+/** Smallest relative decrease in the SAH cost of a treelet for it to be restructured */
+const static scalar TREELET_MIN_GAIN = 1e-4;
+
+/** Fewest edits after which the top level is re-optimized, regardless of its size */
+const static size_t MIN_REOPTIMIZE_EDITS = 16;
+
+bvh_options::bvh_options() :
+    split_method(BVHSplitMethod::SAH),
+    max_leaf_size(4),
+    sah_bins(16),
+    traversal_cost(1.0),
+    intersection_cost(1.0),
+    width(4),
+    lbvh_refine(false),
+    sbvh_budget(0.3),
+    sbvh_overlap(1e-5),
+    rebuild_threshold(1.5),
+    reoptimize_fraction(0.25),
+    treelet_passes(0),
+    quantize(false),
+    report(false)
+{
+}
+
+bvh_stats::bvh_stats() :
+    interior_nodes(0),
+    leaves(0),
+    children(0),
+    references(0),
+    sah_cost(0),
+    overlap(0)
+{
+}
+
+traversal_stats::traversal_stats() :
+    rays(0),
+    nodes_visited(0),
+    boxes_tested(0),
+    triangles_tested(0)
+{
+}
+
+traversal_stats& traversal_stats::operator+=(const traversal_stats& other)
+{
+    rays += other.rays;
+    nodes_visited += other.nodes_visited;
+    boxes_tested += other.boxes_tested;
+    triangles_tested += other.triangles_tested;
+    return *this;
+}
 
 /**
- * Build the leaves of the BVH from objects in the scene recursively.
+ * Collect the mesh instances of the scene graph recursively, in depth first order.
+ *
+ * @param animation If not null, node transforms are taken from the animation at the given time.
+ * @param instance_xform_ids Receives the transform id of each instance. Instances of the same node
+ * share the id, which is the index of the first of them.
  */
-static void build_bvh_leaves(  std::vector<std::shared_ptr<BVNode>>& leaves,
-                                const Scene& scene_graph, const aiNode* node,
-                                const mat4& xform)
+static void gather_instances(const aiNode* node, const mat4& xform,
+                             const SceneAnimation *animation, double time,
+                             std::vector<mat4>& instance_xforms,
+                             std::vector<size_t>& instance_meshes,
+                             std::vector<uint32_t>& instance_xform_ids)
 {
-    mat4 this_xform = xform * assimp_mat_to_glm(node->mTransformation);
+    mat4 this_xform = xform * (animation != nullptr ? animation->node_transform(*node, time)
+            : assimp_mat_to_glm(node->mTransformation));
+    uint32_t xform_id = (uint32_t)instance_xforms.size();
     for (unsigned int i = 0; i < node->mNumMeshes; ++i) {
-        const Mesh& mesh = scene_graph.mesh_list()[node->mMeshes[i]];
-        auto instance = std::make_unique<MeshInstance>(mesh, this_xform);
-        leaves.emplace_back(std::make_shared<BVNode>(aabb(*instance), instance));
+        instance_xforms.push_back(this_xform);
+        instance_meshes.push_back(node->mMeshes[i]);
+        instance_xform_ids.push_back(xform_id);
     }
     for (unsigned int i = 0; i < node->mNumChildren; ++i) {
-        build_bvh_leaves(leaves, scene_graph, node->mChildren[i], this_xform);
+        gather_instances(node->mChildren[i], this_xform, animation, time, instance_xforms,
+                instance_meshes, instance_xform_ids);
     }
 }
 
@@ -53,46 +139,22 @@ struct axis_sort {
 
     axis_sort(int c) : c(c) {}
 
-    inline bool operator()(const std::shared_ptr<BVNode>& a, const std::shared_ptr<BVNode>& b) const
+    inline bool operator()(const bvh_primitive& a, const bvh_primitive& b) const
     {
         scalar mida, midb;
-        auto& bva = a->bounding_volume();
-        auto& bvb = b->bounding_volume();
-        mida = (bva.min[c] + bva.max[c]) * 0.5;
-        midb = (bvb.min[c] + bvb.max[c]) * 0.5;
+        mida = (a.bounds.min[c] + a.bounds.max[c]) * 0.5;
+        midb = (b.bounds.min[c] + b.bounds.max[c]) * 0.5;
         return mida < midb;
     }
 };
 
-typedef std::vector<std::shared_ptr<BVNode>>::iterator bvn_iter;
+typedef std::vector<bvh_primitive>::iterator prim_iter;
 
 /**
- * Build the BVH tree in a top down manner, recursively.
+ * Split a range of primitives at the median centroid along the longest axis of the node.
  */
-static std::shared_ptr<BVNode> build_bvh_topdown(bvn_iter begin, bvn_iter end)
+static prim_iter split_median(prim_iter begin, prim_iter end, const aabb& box)
 {
-    if (begin == end) {
-        return nullptr;
-    }
-    size_t itersize = std::distance(begin, end);
-    if (itersize == 1) {
-        return *begin;
-    }
-    // Compute node AABB
-    aabb box;
-    box.min = VEC3_MAXIMUM;
-    box.max = VEC3_MINIMUM;
-    for (auto it = begin; it != end; ++it) {
-        auto& bv = (*it)->bounding_volume();
-        for (int c = 0; c < 3; ++c) {
-            if (bv.min[c] < box.min[c]) {
-                box.min[c] = bv.min[c];
-            }
-            if (bv.max[c] > box.max[c]) {
-                box.max[c] = bv.max[c];
-            }
-        }
-    }
     // Compute longest axis
     vec3 length = box.max - box.min;
     scalar max_axis = length.x;
@@ -103,98 +165,3061 @@ static std::shared_ptr<BVNode> build_bvh_topdown(bvn_iter begin, bvn_iter end)
             max_idx = c;
         }
     }
-    // Sort iterator range along longest axis
+    // Sort iterator range along longest axis, and split in half
     std::sort(begin, end, axis_sort(max_idx));
-    // Split iterator range in half and recurse
-    auto half = begin + itersize/2;
-    auto left = build_bvh_topdown(begin, half);
-    auto right = build_bvh_topdown(half, end);
-    return std::make_shared<BVNode>(box, left, right);
+    return begin + std::distance(begin, end)/2;
 }
 
-BVH::BVH(const Scene& scene_graph)
+/**
+ * Best partition of a range of primitives found by the binned surface area heuristic.
+ */
+struct sah_split {
+    int axis; // -1 if no plane separates the primitives
+    size_t bin; // Primitives in bins before this one go to the left child
+    scalar cost;
+    aabb left, right; // Bounds of either side of the split
+};
+
+/**
+ * Find the best object partition of a range of primitives with the binned surface area
+ * heuristic. Centroids are binned along each axis, and the plane between bins with the lowest
+ * expected cost is chosen.
+ *
+ * @param centroids Bounds of the primitive centroids.
+ */
+static sah_split find_object_split(prim_iter begin, prim_iter end, const aabb& box,
+                                   const aabb& centroids, const bvh_options& opts)
 {
-    std::vector<std::shared_ptr<BVNode>> leaves;
-    build_bvh_leaves(leaves, scene_graph, scene_graph.assimp_scene()->mRootNode, MAT4_IDENTITY);
-    std::cout << "BVH: Instanced " << leaves.size() << " meshes from scene graph" << std::endl;
-    for (auto& leaf : leaves) {
-        std::cout << "\tAABB Extents:"
-            << " min=" << glm::to_string(leaf->m_volume.min)
-            << " max=" << glm::to_string(leaf->m_volume.max)
-            << std::endl;
+    struct sah_bin {
+        aabb bounds;
+        size_t count;
+    };
+    size_t nbins = std::max<size_t>(opts.sah_bins, 2);
+    std::vector<sah_bin> bins(nbins);
+    std::vector<aabb> right_bounds(nbins);
+    std::vector<size_t> right_count(nbins);
+    scalar box_area = box.surface_area();
+    sah_split best;
+    best.axis = -1;
+    best.bin = 0;
+    best.cost = SCALAR_INF;
+    for (int c = 0; c < 3; ++c) {
+        scalar extent = centroids.max[c] - centroids.min[c];
+        if (!(extent > 0)) {
+            // All centroids lie on the same plane along this axis
+            continue;
+        }
+        scalar bin_scale = nbins / extent;
+        for (auto& b : bins) {
+            b.bounds = aabb::empty();
+            b.count = 0;
+        }
+        for (auto it = begin; it != end; ++it) {
+            size_t b = (size_t)((it->bounds.centroid()[c] - centroids.min[c]) * bin_scale);
+            b = std::min(b, nbins - 1);
+            bins[b].bounds.extend(it->bounds);
+            bins[b].count++;
+        }
+        // Sweep from the right to accumulate the bounds of everything past each split plane
+        aabb acc = aabb::empty();
+        size_t acc_count = 0;
+        for (size_t i = nbins - 1; i > 0; --i) {
+            acc.extend(bins[i].bounds);
+            acc_count += bins[i].count;
+            right_bounds[i] = acc;
+            right_count[i] = acc_count;
+        }
+        // Sweep from the left, evaluating the cost of splitting before bin i
+        acc = aabb::empty();
+        acc_count = 0;
+        for (size_t i = 1; i < nbins; ++i) {
+            acc.extend(bins[i - 1].bounds);
+            acc_count += bins[i - 1].count;
+            if (acc_count == 0 || right_count[i] == 0) {
+                continue;
+            }
+            scalar cost = opts.traversal_cost + opts.intersection_cost
+                * (acc.surface_area() * acc_count + right_bounds[i].surface_area() * right_count[i])
+                / box_area;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = c;
+                best.bin = i;
+                best.left = acc;
+                best.right = right_bounds[i];
+            }
+        }
     }
-    m_root = build_bvh_topdown(leaves.begin(), leaves.end());
+    return best;
 }
 
-trace_info BVH::trace_ray(const Ray& r) const
+/**
+ * Partition a range of primitives by the side of an object split their centroids fall on.
+ */
+static prim_iter partition_object_split(prim_iter begin, prim_iter end, const aabb& centroids,
+                                        const sah_split& split, const bvh_options& opts)
 {
-    struct leaf_trace {
-        BVNode *leaf;
-        scalar dist;
-        leaf_trace(BVNode *n, scalar d) :
-            leaf(n), dist(d) {}
-    };
-    trace_info info;
-    info.hitobj = nullptr;
-    std::vector<BVNode*> to_search;
-    std::vector<leaf_trace> hit_leaves;
-    if (m_root != nullptr) {
-        to_search.push_back(m_root.get());
+    size_t nbins = std::max<size_t>(opts.sah_bins, 2);
+    scalar cmin = centroids.min[split.axis];
+    scalar bin_scale = nbins / (centroids.max[split.axis] - cmin);
+    return std::partition(begin, end, [&](const bvh_primitive& p) {
+            size_t b = (size_t)((p.bounds.centroid()[split.axis] - cmin) * bin_scale);
+            return std::min(b, nbins - 1) < split.bin;
+        });
+}
+
+/**
+ * Split a range of primitives using the binned surface area heuristic.
+ *
+ * @param make_leaf Set to true if the range is cheaper to keep as a single leaf than to split.
+ * @return The partition point of the range. Only valid if make_leaf is false.
+ */
+static prim_iter split_sah(prim_iter begin, prim_iter end, const aabb& box,
+                           const bvh_options& opts, size_t max_leaf_size, bool& make_leaf)
+{
+    size_t count = std::distance(begin, end);
+    aabb centroids = aabb::empty();
+    for (auto it = begin; it != end; ++it) {
+        centroids.extend(it->bounds.centroid());
     }
-    // Trace through tree, pruning branches as needed
-    while (!to_search.empty()) {
-        BVNode *n = to_search.back();
-        to_search.pop_back();
-        trace_result result = r.intersect_aabb(n->bounding_volume());
-        if (result.intersect_type == IntersectionType::Intersected || result.intersect_type == IntersectionType::InsideVolume) {
-            //std::cout << "AABB HIT\n";
-            if (n->is_leaf()) {
-                hit_leaves.emplace_back(n, result.distance);
-            } else {
-                if (n->m_left != nullptr) {
-                    to_search.push_back(n->m_left.get());
+    sah_split best = find_object_split(begin, end, box, centroids, opts);
+    scalar leaf_cost = opts.intersection_cost * count;
+    if (best.axis < 0 || !(box.surface_area() > 0)) {
+        // No plane separates the centroids; Only split if the leaf would be too large
+        make_leaf = count <= max_leaf_size;
+        return make_leaf ? end : begin + count/2;
+    }
+    if (count <= max_leaf_size && leaf_cost <= best.cost) {
+        make_leaf = true;
+        return end;
+    }
+    make_leaf = false;
+    return partition_object_split(begin, end, centroids, best, opts);
+}
+
+/**
+ * Build the BVH tree in a top down manner, recursively. Leaves refer to ranges of the primitive
+ * list, which is reordered in place. Large partitions are built as separate tasks.
+ *
+ * @param base Beginning of the full primitive list, used to compute leaf offsets.
+ * @param max_leaf_size Ranges larger than this are always split.
+ * @param scheduler Runs subtrees built in parallel. May be null.
+ */
+static std::shared_ptr<BVNode> build_bvh_topdown(prim_iter base, prim_iter begin, prim_iter end,
+                                                 const bvh_options& opts, size_t max_leaf_size,
+                                                 TaskScheduler *scheduler)
+{
+    if (begin == end) {
+        return nullptr;
+    }
+    size_t itersize = std::distance(begin, end);
+    // Compute node AABB
+    aabb box = aabb::empty();
+    for (auto it = begin; it != end; ++it) {
+        box.extend(it->bounds);
+    }
+    if (itersize == 1) {
+        return std::make_shared<BVNode>(box, std::distance(base, begin), itersize);
+    }
+    prim_iter mid;
+    switch (opts.split_method) {
+        case BVHSplitMethod::Median: {
+            if (itersize <= max_leaf_size) {
+                return std::make_shared<BVNode>(box, std::distance(base, begin), itersize);
+            }
+            mid = split_median(begin, end, box);
+        } break;
+        case BVHSplitMethod::SAH:
+        case BVHSplitMethod::LBVH:
+        case BVHSplitMethod::SBVH: {
+            // LBVH builds come through here when refining their top levels, and SBVH builds when
+            // primitives can't be clipped
+            bool make_leaf;
+            mid = split_sah(begin, end, box, opts, max_leaf_size, make_leaf);
+            if (make_leaf) {
+                return std::make_shared<BVNode>(box, std::distance(base, begin), itersize);
+            }
+        } break;
+    }
+    std::shared_ptr<BVNode> left, right;
+    if (scheduler != nullptr && itersize >= PARALLEL_BUILD_THRESHOLD) {
+        TaskGroup subtree(scheduler);
+        subtree.run([&]() {
+                left = build_bvh_topdown(base, begin, mid, opts, max_leaf_size, scheduler);
+            });
+        right = build_bvh_topdown(base, mid, end, opts, max_leaf_size, scheduler);
+        subtree.wait();
+    } else {
+        left = build_bvh_topdown(base, begin, mid, opts, max_leaf_size, scheduler);
+        right = build_bvh_topdown(base, mid, end, opts, max_leaf_size, scheduler);
+    }
+    return std::make_shared<BVNode>(box, left, right);
+}
+
+/** Number of leading Morton code bits used to group primitives into clusters for SAH refinement */
+const static int LBVH_CLUSTER_BITS = 15;
+
+/** Number of Morton code entries sorted as one chunk by each radix sort task */
+const static size_t RADIX_SORT_CHUNK = 16384;
+
+struct morton_entry {
+    uint64_t code;
+    size_t prim;
+};
+
+/**
+ * Sort Morton entries by code with a least significant digit radix sort. Each pass histograms
+ * and scatters fixed chunks of the input in parallel. Passes over digits shared by every code are
+ * skipped.
+ */
+static void radix_sort(std::vector<morton_entry>& entries, TaskScheduler *scheduler)
+{
+    const int RADIX_BITS = 8;
+    const size_t RADIX = 1 << RADIX_BITS;
+    size_t nchunks = (entries.size() + RADIX_SORT_CHUNK - 1) / RADIX_SORT_CHUNK;
+    std::vector<morton_entry> scratch(entries.size());
+    std::vector<size_t> offsets(nchunks * RADIX);
+    for (int shift = 0; shift < 64; shift += RADIX_BITS) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallel_for(scheduler, nchunks, 1, [&](size_t chunk) {
+                size_t *hist = &offsets[chunk * RADIX];
+                size_t end = std::min((chunk + 1) * RADIX_SORT_CHUNK, entries.size());
+                for (size_t i = chunk * RADIX_SORT_CHUNK; i < end; ++i) {
+                    hist[(entries[i].code >> shift) & (RADIX - 1)]++;
                 }
-                if (n->m_right != nullptr) {
-                    to_search.push_back(n->m_right.get());
+            });
+        // Convert counts to scatter offsets, ordered by digit, then by chunk
+        size_t total = 0;
+        bool uniform = false;
+        for (size_t d = 0; d < RADIX; ++d) {
+            size_t digit_total = 0;
+            for (size_t chunk = 0; chunk < nchunks; ++chunk) {
+                size_t count = offsets[chunk * RADIX + d];
+                offsets[chunk * RADIX + d] = total;
+                total += count;
+                digit_total += count;
+            }
+            if (digit_total == entries.size()) {
+                uniform = true;
+            }
+        }
+        if (uniform) {
+            continue;
+        }
+        parallel_for(scheduler, nchunks, 1, [&](size_t chunk) {
+                size_t *offset = &offsets[chunk * RADIX];
+                size_t end = std::min((chunk + 1) * RADIX_SORT_CHUNK, entries.size());
+                for (size_t i = chunk * RADIX_SORT_CHUNK; i < end; ++i) {
+                    scratch[offset[(entries[i].code >> shift) & (RADIX - 1)]++] = entries[i];
                 }
+            });
+        entries.swap(scratch);
+    }
+}
+
+/**
+ * Find the position to split a range of sorted Morton codes, at the highest bit which differs
+ * within the range.
+ *
+ * @return Index of the last entry in the left half of the range [first, last].
+ */
+static size_t find_morton_split(const std::vector<morton_entry>& entries, size_t first, size_t last)
+{
+    uint64_t first_code = entries[first].code;
+    uint64_t last_code = entries[last].code;
+    if (first_code == last_code) {
+        return (first + last) / 2;
+    }
+    int prefix = __builtin_clzll(first_code ^ last_code);
+    // Binary search for the last code sharing more than the common prefix with the first
+    size_t split = first;
+    size_t step = last - first;
+    do {
+        step = (step + 1) / 2;
+        size_t candidate = split + step;
+        if (candidate < last && __builtin_clzll(first_code ^ entries[candidate].code) > prefix) {
+            split = candidate;
+        }
+    } while (step > 1);
+    return split;
+}
+
+/**
+ * Emit the hierarchy for a range of Morton sorted primitives, splitting at the highest differing
+ * code bit. Bounds are computed bottom up.
+ *
+ * @param first Index of the first primitive in the range.
+ * @param last Index of the last primitive in the range, inclusive.
+ */
+static std::shared_ptr<BVNode> build_lbvh_range(const std::vector<bvh_primitive>& prims,
+                                                const std::vector<morton_entry>& entries,
+                                                size_t first, size_t last, size_t max_leaf_size,
+                                                TaskScheduler *scheduler)
+{
+    size_t count = last - first + 1;
+    if (count <= max_leaf_size || count == 1) {
+        aabb box = aabb::empty();
+        for (size_t i = first; i <= last; ++i) {
+            box.extend(prims[i].bounds);
+        }
+        return std::make_shared<BVNode>(box, first, count);
+    }
+    size_t split = find_morton_split(entries, first, last);
+    std::shared_ptr<BVNode> left, right;
+    if (scheduler != nullptr && count >= PARALLEL_BUILD_THRESHOLD) {
+        TaskGroup subtree(scheduler);
+        subtree.run([&]() {
+                left = build_lbvh_range(prims, entries, first, split, max_leaf_size, scheduler);
+            });
+        right = build_lbvh_range(prims, entries, split + 1, last, max_leaf_size, scheduler);
+        subtree.wait();
+    } else {
+        left = build_lbvh_range(prims, entries, first, split, max_leaf_size, scheduler);
+        right = build_lbvh_range(prims, entries, split + 1, last, max_leaf_size, scheduler);
+    }
+    aabb box = left->bounding_volume();
+    box.extend(right->bounding_volume());
+    return std::make_shared<BVNode>(box, left, right);
+}
+
+/**
+ * Replace the leaves of a tree built over clusters with the subtrees of those clusters.
+ *
+ * @param clusters Cluster list the top level tree was built over, in leaf order.
+ */
+static std::shared_ptr<BVNode> graft_clusters(const BVNode *n,
+                                              const std::vector<bvh_primitive>& clusters,
+                                              const std::vector<std::shared_ptr<BVNode>>& subtrees)
+{
+    if (n->is_leaf()) {
+        return subtrees[clusters[n->first_primitive()].index];
+    }
+    auto left = graft_clusters(n->left(), clusters, subtrees);
+    auto right = graft_clusters(n->right(), clusters, subtrees);
+    return std::make_shared<BVNode>(n->bounding_volume(), left, right);
+}
+
+/**
+ * Build a linear BVH. Primitives are sorted along a Morton curve through their centroids, and the
+ * hierarchy is emitted by splitting at Morton code bits. The primitive list is reordered in place.
+ *
+ * If opts.lbvh_refine is set, primitives are grouped into clusters by the leading bits of their
+ * Morton codes. Each cluster is built as an LBVH, and the levels above them are rebuilt with SAH.
+ */
+static std::shared_ptr<BVNode> build_lbvh(std::vector<bvh_primitive>& prims,
+                                          const bvh_options& opts, size_t max_leaf_size,
+                                          TaskScheduler *scheduler)
+{
+    if (prims.empty()) {
+        return nullptr;
+    }
+    // Compute Morton codes relative to the bounds of the centroids
+    aabb centroids = aabb::empty();
+    for (auto& p : prims) {
+        centroids.extend(p.bounds.centroid());
+    }
+    std::vector<morton_entry> entries(prims.size());
+    parallel_for(scheduler, prims.size(), RADIX_SORT_CHUNK,
+            [&](size_t i) {
+                entries[i].code = centroids.morton_code(prims[i].bounds.centroid());
+                entries[i].prim = i;
+            });
+    radix_sort(entries, scheduler);
+    std::vector<bvh_primitive> sorted;
+    sorted.reserve(prims.size());
+    for (auto& e : entries) {
+        sorted.push_back(prims[e.prim]);
+    }
+    prims.swap(sorted);
+    if (!opts.lbvh_refine) {
+        return build_lbvh_range(prims, entries, 0, prims.size() - 1, max_leaf_size, scheduler);
+    }
+    // Build an LBVH for each cluster of primitives sharing their leading Morton code bits
+    std::vector<std::pair<size_t, size_t>> ranges;
+    size_t start = 0;
+    for (size_t i = 1; i <= entries.size(); ++i) {
+        if (i == entries.size() || (entries[i].code >> (63 - LBVH_CLUSTER_BITS))
+                != (entries[start].code >> (63 - LBVH_CLUSTER_BITS))) {
+            ranges.emplace_back(start, i - 1);
+            start = i;
+        }
+    }
+    std::vector<std::shared_ptr<BVNode>> subtrees(ranges.size());
+    parallel_for(scheduler, ranges.size(), 1, [&](size_t i) {
+            subtrees[i] = build_lbvh_range(prims, entries, ranges[i].first, ranges[i].second,
+                    max_leaf_size, scheduler);
+        });
+    // Rebuild the levels above the clusters with SAH, treating each cluster as one primitive
+    std::vector<bvh_primitive> clusters;
+    clusters.reserve(subtrees.size());
+    for (size_t i = 0; i < subtrees.size(); ++i) {
+        clusters.emplace_back(subtrees[i]->bounding_volume(), i);
+    }
+    bvh_options top_opts = opts;
+    top_opts.split_method = BVHSplitMethod::SAH;
+    auto top = build_bvh_topdown(clusters.begin(), clusters.begin(), clusters.end(), top_opts, 1,
+            scheduler);
+    return graft_clusters(top.get(), clusters, subtrees);
+}
+
+/**
+ * State shared by every node of a spatial split build.
+ */
+struct sbvh_context {
+    const bvh_options& opts;
+    const bvh_split_fn& clip;
+    size_t max_leaf_size;
+    scalar root_area;
+    size_t spare_references; // Remaining number of references spatial splits may duplicate
+    std::vector<bvh_primitive> leaves; // References in leaf order
+
+    sbvh_context(const bvh_options& opts, const bvh_split_fn& clip, size_t max_leaf_size) :
+        opts(opts), clip(clip), max_leaf_size(max_leaf_size), root_area(0), spare_references(0) {}
+};
+
+/**
+ * Best spatial partition of a range of references, see find_spatial_split.
+ */
+struct spatial_split {
+    int axis; // -1 if no plane separates the references
+    scalar plane;
+    scalar cost;
+    size_t left_count, right_count;
+};
+
+/**
+ * Find the best spatial partition of a range of references. The node is divided into equal bins
+ * along each axis, and each reference is clipped into every bin it overlaps. Unlike object splits,
+ * a reference may end up on both sides of the plane.
+ */
+static spatial_split find_spatial_split(const sbvh_context& ctx,
+                                        const std::vector<bvh_primitive>& refs, const aabb& box)
+{
+    struct spatial_bin {
+        aabb bounds;
+        size_t entries, exits; // References starting and ending in this bin
+    };
+    size_t nbins = std::max<size_t>(ctx.opts.sah_bins, 2);
+    std::vector<spatial_bin> bins(nbins);
+    std::vector<aabb> right_bounds(nbins);
+    std::vector<size_t> right_count(nbins);
+    scalar box_area = box.surface_area();
+    spatial_split best;
+    best.axis = -1;
+    best.cost = SCALAR_INF;
+    for (int c = 0; c < 3; ++c) {
+        scalar extent = box.max[c] - box.min[c];
+        if (!(extent > 0)) {
+            continue;
+        }
+        scalar bin_width = extent / nbins;
+        for (auto& b : bins) {
+            b.bounds = aabb::empty();
+            b.entries = 0;
+            b.exits = 0;
+        }
+        for (auto& ref : refs) {
+            size_t first = (size_t)glm::clamp((ref.bounds.min[c] - box.min[c]) / bin_width,
+                    (scalar)0, (scalar)(nbins - 1));
+            size_t last = (size_t)glm::clamp((ref.bounds.max[c] - box.min[c]) / bin_width,
+                    (scalar)first, (scalar)(nbins - 1));
+            // Chop the reference at each bin boundary it crosses
+            bvh_primitive rest = ref;
+            for (size_t b = first; b < last; ++b) {
+                aabb left, right;
+                ctx.clip(rest, c, box.min[c] + bin_width * (b + 1), left, right);
+                bins[b].bounds.extend(left);
+                rest.bounds = right;
+            }
+            bins[last].bounds.extend(rest.bounds);
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+        aabb acc = aabb::empty();
+        size_t acc_count = 0;
+        for (size_t i = nbins - 1; i > 0; --i) {
+            acc.extend(bins[i].bounds);
+            acc_count += bins[i].exits;
+            right_bounds[i] = acc;
+            right_count[i] = acc_count;
+        }
+        acc = aabb::empty();
+        acc_count = 0;
+        for (size_t i = 1; i < nbins; ++i) {
+            acc.extend(bins[i - 1].bounds);
+            acc_count += bins[i - 1].entries;
+            if (acc_count == 0 || right_count[i] == 0) {
+                continue;
+            }
+            scalar cost = ctx.opts.traversal_cost + ctx.opts.intersection_cost
+                * (acc.surface_area() * acc_count + right_bounds[i].surface_area() * right_count[i])
+                / box_area;
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.axis = c;
+                best.plane = box.min[c] + bin_width * i;
+                best.left_count = acc_count;
+                best.right_count = right_count[i];
             }
+        }
+    }
+    return best;
+}
+
+/**
+ * Divide references between the sides of a spatial split. References straddling the plane are
+ * clipped into both children, unless moving them entirely to one side is expected to be cheaper.
+ */
+static void partition_spatial_split(sbvh_context& ctx, const std::vector<bvh_primitive>& refs,
+                                    const spatial_split& split, std::vector<bvh_primitive>& left,
+                                    std::vector<bvh_primitive>& right)
+{
+    int c = split.axis;
+    aabb left_box = aabb::empty(), right_box = aabb::empty();
+    std::vector<bvh_primitive> straddling;
+    for (auto& ref : refs) {
+        if (ref.bounds.max[c] <= split.plane) {
+            left.push_back(ref);
+            left_box.extend(ref.bounds);
+        } else if (ref.bounds.min[c] >= split.plane) {
+            right.push_back(ref);
+            right_box.extend(ref.bounds);
+        } else {
+            straddling.push_back(ref);
+        }
+    }
+    size_t left_count = left.size() + straddling.size();
+    size_t right_count = right.size() + straddling.size();
+    for (auto& ref : straddling) {
+        aabb left_part, right_part;
+        ctx.clip(ref, c, split.plane, left_part, right_part);
+        if (!(left_part.min[c] <= left_part.max[c])) {
+            right.emplace_back(right_part, ref.index);
+            right_box.extend(right_part);
+            left_count--;
+            continue;
+        }
+        if (!(right_part.min[c] <= right_part.max[c])) {
+            left.emplace_back(left_part, ref.index);
+            left_box.extend(left_part);
+            right_count--;
+            continue;
+        }
+        // Compare the cost of duplicating the reference with keeping it whole on either side
+        aabb left_whole = left_box, right_whole = right_box;
+        left_whole.extend(ref.bounds);
+        right_whole.extend(ref.bounds);
+        aabb left_split = left_box, right_split = right_box;
+        left_split.extend(left_part);
+        right_split.extend(right_part);
+        scalar split_cost = left_split.surface_area() * left_count
+            + right_split.surface_area() * right_count;
+        scalar left_cost = left_whole.surface_area() * left_count
+            + right_box.surface_area() * (right_count - 1);
+        scalar right_cost = left_box.surface_area() * (left_count - 1)
+            + right_whole.surface_area() * right_count;
+        if (split_cost <= left_cost && split_cost <= right_cost) {
+            left.emplace_back(left_part, ref.index);
+            right.emplace_back(right_part, ref.index);
+            left_box = left_split;
+            right_box = right_split;
+        } else if (left_cost <= right_cost) {
+            left.push_back(ref);
+            left_box = left_whole;
+            right_count--;
+        } else {
+            right.push_back(ref);
+            right_box = right_whole;
+            left_count--;
+        }
+    }
+}
+
+/**
+ * Build a spatial split BVH over a list of references, recursively. Object splits are evaluated
+ * first, and spatial splits are only tried when the children of the best object split overlap
+ * significantly, while the reference budget allows.
+ */
+static std::shared_ptr<BVNode> build_sbvh(sbvh_context& ctx, std::vector<bvh_primitive>& refs)
+{
+    aabb box = aabb::empty();
+    aabb centroids = aabb::empty();
+    for (auto& ref : refs) {
+        box.extend(ref.bounds);
+        centroids.extend(ref.bounds.centroid());
+    }
+    size_t count = refs.size();
+    auto make_leaf = [&]() {
+        size_t first = ctx.leaves.size();
+        ctx.leaves.insert(ctx.leaves.end(), refs.begin(), refs.end());
+        return std::make_shared<BVNode>(box, first, count);
+    };
+    if (count == 1) {
+        return make_leaf();
+    }
+    sah_split object = find_object_split(refs.begin(), refs.end(), box, centroids, ctx.opts);
+    spatial_split spatial;
+    spatial.axis = -1;
+    spatial.cost = SCALAR_INF;
+    if (ctx.spare_references > 0 && object.axis >= 0 && ctx.root_area > 0) {
+        aabb overlap;
+        overlap.min = glm::max(object.left.min, object.right.min);
+        overlap.max = glm::min(object.left.max, object.right.max);
+        if (overlap.surface_area() / ctx.root_area > ctx.opts.sbvh_overlap) {
+            spatial = find_spatial_split(ctx, refs, box);
+        }
+    }
+    scalar leaf_cost = ctx.opts.intersection_cost * count;
+    scalar best_cost = std::min(object.cost, spatial.cost);
+    if (count <= ctx.max_leaf_size && (best_cost == SCALAR_INF || leaf_cost <= best_cost)) {
+        return make_leaf();
+    }
+    std::vector<bvh_primitive> left, right;
+    if (spatial.axis >= 0 && spatial.cost < object.cost
+            && spatial.left_count + spatial.right_count - count <= ctx.spare_references) {
+        partition_spatial_split(ctx, refs, spatial, left, right);
+        size_t duplicated = left.size() + right.size() - count;
+        ctx.spare_references -= std::min(duplicated, ctx.spare_references);
+    } else {
+        prim_iter mid;
+        if (object.axis >= 0) {
+            mid = partition_object_split(refs.begin(), refs.end(), centroids, object, ctx.opts);
         } else {
-            switch (result.intersect_type) {
-                case IntersectionType::None: {
-                    //std::cout << "(NONE)\n";
-                } break;
-                case IntersectionType::BehindRay: {
-                    //std::cout << "(BEHIND)\n";
-                } break;
-                default: {
-                    //std::cout << "(UNKNOWN)\n";
-                }
-            }
-        }
-    }
-    // Find closest intersection
-    std::sort(hit_leaves.begin(), hit_leaves.end(),
-            [](const auto& a, const auto& b) { return a.dist < b.dist; });
-    info.distance = SCALAR_INF;
-    for (auto& lt : hit_leaves) {
-        if (info.distance < lt.dist) {
-            // Early stop, we already know the best possible trace
+            mid = refs.begin() + count/2;
+        }
+        left.assign(refs.begin(), mid);
+        right.assign(mid, refs.end());
+    }
+    if (left.empty() || right.empty()) {
+        if (count <= ctx.max_leaf_size) {
+            return make_leaf();
+        }
+        left.assign(refs.begin(), refs.begin() + count/2);
+        right.assign(refs.begin() + count/2, refs.end());
+    }
+    // Release the references of this node before descending
+    std::vector<bvh_primitive>().swap(refs);
+    auto left_node = build_sbvh(ctx, left);
+    auto right_node = build_sbvh(ctx, right);
+    return std::make_shared<BVNode>(box, left_node, right_node);
+}
+
+/**
+ * Flatten a BVH build tree into a node array in depth first order. The children of each interior
+ * node are stored next to each other.
+ *
+ * @param index Index of the already allocated slot for n.
+ */
+static void flatten_bvh(const BVNode *n, std::vector<bvh_node>& nodes, size_t index)
+{
+    nodes[index].volume = n->bounding_volume();
+    if (n->is_leaf()) {
+        nodes[index].offset = n->first_primitive();
+        nodes[index].count = n->primitive_count();
+        return;
+    }
+    size_t children = nodes.size();
+    nodes.resize(children + 2);
+    nodes[index].offset = children;
+    nodes[index].count = 0;
+    flatten_bvh(n->left(), nodes, children);
+    flatten_bvh(n->right(), nodes, children + 1);
+}
+
+/**
+ * Round a scalar down to the nearest single precision float.
+ */
+static inline float round_down(scalar v)
+{
+    float f = (float)v;
+    if ((scalar)f > v) {
+        f = std::nextafter(f, -std::numeric_limits<float>::infinity());
+    }
+    return f;
+}
+
+/**
+ * Round a scalar up to the nearest single precision float.
+ */
+static inline float round_up(scalar v)
+{
+    float f = (float)v;
+    if ((scalar)f < v) {
+        f = std::nextafter(f, std::numeric_limits<float>::infinity());
+    }
+    return f;
+}
+
+/**
+ * Pick the binary nodes which become the children of a wide node. Interior children with the
+ * largest surface area are repeatedly replaced by their own children until all N slots are used.
+ *
+ * @param node Index of the binary node.
+ * @param kids Receives the indices of the chosen binary nodes.
+ * @return Number of children chosen.
+ */
+template <size_t N>
+static size_t select_wide_children(const std::vector<bvh_node>& nodes, uint32_t node,
+                                   uint32_t (&kids)[N])
+{
+    size_t nkids = 0;
+    if (nodes[node].is_leaf()) {
+        kids[nkids++] = node;
+        return nkids;
+    }
+    kids[nkids++] = nodes[node].offset;
+    kids[nkids++] = nodes[node].offset + 1;
+    while (nkids < N) {
+        int best = -1;
+        scalar best_area = -1;
+        for (size_t i = 0; i < nkids; ++i) {
+            const bvh_node& k = nodes[kids[i]];
+            if (!k.is_leaf() && k.volume.surface_area() > best_area) {
+                best = i;
+                best_area = k.volume.surface_area();
+            }
+        }
+        if (best < 0) {
+            // Every child is already a leaf
             break;
         }
-        struct trace_info temp = r.intersect_mesh(*(lt.leaf->object()));
-        if (temp.hitobj != nullptr && temp.distance < info.distance) {
-            info = temp;
+        uint32_t expand = kids[best];
+        kids[best] = nodes[expand].offset;
+        kids[nkids++] = nodes[expand].offset + 1;
+    }
+    return nkids;
+}
+
+/**
+ * Collapse the subtree of a binary node into a wide node.
+ *
+ * @param node Index of the binary node.
+ * @param index Index of the already allocated wide node.
+ */
+template <size_t N>
+static void collapse_bvh(const std::vector<bvh_node>& nodes, uint32_t node,
+                         std::vector<bvh_wide_node<N>>& wide, size_t index)
+{
+    uint32_t kids[N];
+    size_t nkids = select_wide_children(nodes, node, kids);
+    for (size_t i = 0; i < N; ++i) {
+        auto& w = wide[index];
+        if (i >= nkids) {
+            for (int c = 0; c < 3; ++c) {
+                w.bounds_min[c][i] = std::numeric_limits<float>::infinity();
+                w.bounds_max[c][i] = -std::numeric_limits<float>::infinity();
+            }
+            w.child[i] = bvh_wide_node<N>::EMPTY;
+            w.count[i] = 0;
+            continue;
+        }
+        const bvh_node& k = nodes[kids[i]];
+        for (int c = 0; c < 3; ++c) {
+            w.bounds_min[c][i] = round_down(k.volume.min[c]);
+            w.bounds_max[c][i] = round_up(k.volume.max[c]);
+        }
+        if (k.is_leaf()) {
+            w.child[i] = k.offset;
+            w.count[i] = k.count;
+        } else {
+            w.child[i] = wide.size();
+            w.count[i] = 0;
+            wide.emplace_back();
+            collapse_bvh(nodes, kids[i], wide, wide[index].child[i]);
         }
     }
-    return info;
+}
+
+/** Smallest and largest grid cell exponents of a quantized node, keeping cell sizes normal */
+const static int QUANTIZE_MIN_EXPONENT = -126;
+const static int QUANTIZE_MAX_EXPONENT = 127;
+
+/**
+ * Get the power of two cell size of a quantized grid. Built from the exponent bits directly, so
+ * decoding a node never calls into the math library.
+ */
+static inline float quantized_scale(int exponent)
+{
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+/**
+ * Decode a quantized plane. The product is exact, so only the sum is rounded, and the result is
+ * the same whether or not the compiler contracts it into a fused multiply add.
+ */
+static inline float dequantize(float origin, uint8_t q, float scale)
+{
+    return origin + q * scale;
+}
+
+/**
+ * Collapse the subtree of a binary node into a quantized wide node, and append the primitives of
+ * its leaf children to a new primitive list in slot order.
+ *
+ * @param node Index of the binary node.
+ * @param index Index of the already allocated quantized node.
+ */
+template <size_t N>
+static void quantize_bvh(const std::vector<bvh_node>& nodes, uint32_t node,
+                         std::vector<bvh_quantized_node<N>>& quantized, size_t index,
+                         const std::vector<bvh_primitive>& prims,
+                         std::vector<bvh_primitive>& quantized_prims)
+{
+    uint32_t kids[N];
+    size_t nkids = select_wide_children(nodes, node, kids);
+    float lo[3][N], hi[3][N];
+    float box_min[3], box_max[3];
+    for (int c = 0; c < 3; ++c) {
+        box_min[c] = std::numeric_limits<float>::infinity();
+        box_max[c] = -std::numeric_limits<float>::infinity();
+        for (size_t i = 0; i < nkids; ++i) {
+            lo[c][i] = round_down(nodes[kids[i]].volume.min[c]);
+            hi[c][i] = round_up(nodes[kids[i]].volume.max[c]);
+            box_min[c] = std::min(box_min[c], lo[c][i]);
+            box_max[c] = std::max(box_max[c], hi[c][i]);
+        }
+    }
+    size_t ninterior = 0;
+    {
+        auto& q = quantized[index];
+        for (int c = 0; c < 3; ++c) {
+            // Find the smallest cells for which the grid still reaches the far side of the node
+            q.origin[c] = box_min[c];
+            float extent = box_max[c] - box_min[c];
+            int e = QUANTIZE_MIN_EXPONENT;
+            if (extent > 0) {
+                e = std::max(std::ilogb(extent / 255.0f), QUANTIZE_MIN_EXPONENT);
+            }
+            while (e < QUANTIZE_MAX_EXPONENT
+                    && dequantize(q.origin[c], 255, quantized_scale(e)) < box_max[c]) {
+                ++e;
+            }
+            q.exponent[c] = (int8_t)e;
+            float scale = quantized_scale(e);
+            for (size_t i = 0; i < N; ++i) {
+                if (i >= nkids) {
+                    q.qmin[c][i] = 0;
+                    q.qmax[c][i] = 0;
+                    continue;
+                }
+                // Round outwards, then correct for the rounding of the division
+                float fmin = std::floor((lo[c][i] - q.origin[c]) / scale);
+                float fmax = std::ceil((hi[c][i] - q.origin[c]) / scale);
+                int qmin = (int)std::min(std::max(fmin, 0.0f), 255.0f);
+                int qmax = (int)std::min(std::max(fmax, 0.0f), 255.0f);
+                while (qmin > 0 && dequantize(q.origin[c], qmin, scale) > lo[c][i]) {
+                    --qmin;
+                }
+                while (qmax < 255 && dequantize(q.origin[c], qmax, scale) < hi[c][i]) {
+                    ++qmax;
+                }
+                q.qmin[c][i] = (uint8_t)qmin;
+                q.qmax[c][i] = (uint8_t)qmax;
+            }
+        }
+        q.prim_base = quantized_prims.size();
+        for (size_t i = 0; i < N; ++i) {
+            if (i >= nkids) {
+                q.meta[i] = bvh_quantized_node<N>::EMPTY;
+                continue;
+            }
+            const bvh_node& k = nodes[kids[i]];
+            if (k.is_leaf()) {
+                q.meta[i] = (uint8_t)k.count;
+                quantized_prims.insert(quantized_prims.end(), prims.begin() + k.offset,
+                        prims.begin() + k.offset + k.count);
+            } else {
+                q.meta[i] = 0;
+                ++ninterior;
+            }
+        }
+        q.child_base = quantized.size();
+    }
+    // Allocate the interior children together, before descending into any of them
+    uint32_t child_base = quantized.size();
+    quantized.resize(quantized.size() + ninterior);
+    for (size_t i = 0, next = child_base; i < nkids; ++i) {
+        if (!nodes[kids[i]].is_leaf()) {
+            quantize_bvh(nodes, kids[i], quantized, next++, prims, quantized_prims);
+        }
+    }
+}
+
+void BVHTree::build(std::vector<bvh_primitive>& prims, const bvh_options& opts, size_t max_leaf_size,
+                    TaskScheduler *scheduler, const bvh_split_fn& clip)
+{
+    m_nodes.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_qnodes4.clear();
+    m_qnodes8.clear();
+    m_parents.clear();
+    m_leaves.clear();
+    m_quantized_cost = 0;
+    m_depth = 0;
+    bool quantized = opts.quantize && (opts.width == 4 || opts.width == 8);
+    // Quantized nodes count the primitives of each leaf in a byte
+    if (quantized && max_leaf_size > bvh_quantized_node<4>::MAX_LEAF_SIZE) {
+        max_leaf_size = bvh_quantized_node<4>::MAX_LEAF_SIZE;
+    }
+    // Treelet restructuring works on single primitives, and gathers them into leaves afterwards
+    size_t build_leaf_size = opts.treelet_passes > 0 ? 1 : max_leaf_size;
+    std::shared_ptr<BVNode> root;
+    if (opts.split_method == BVHSplitMethod::LBVH) {
+        root = build_lbvh(prims, opts, build_leaf_size, scheduler);
+    } else if (opts.split_method == BVHSplitMethod::SBVH && clip && !prims.empty()) {
+        sbvh_context ctx(opts, clip, build_leaf_size);
+        aabb box = aabb::empty();
+        for (auto& p : prims) {
+            box.extend(p.bounds);
+        }
+        ctx.root_area = box.surface_area();
+        ctx.spare_references = (size_t)(prims.size() * std::max<scalar>(opts.sbvh_budget, 0));
+        ctx.leaves.reserve(prims.size() + ctx.spare_references);
+        root = build_sbvh(ctx, prims);
+        prims.swap(ctx.leaves);
+    } else {
+        root = build_bvh_topdown(prims.begin(), prims.begin(), prims.end(), opts, build_leaf_size,
+                scheduler);
+    }
+    if (root == nullptr) {
+        return;
+    }
+    m_nodes.reserve(2 * prims.size());
+    m_nodes.resize(1);
+    flatten_bvh(root.get(), m_nodes, 0);
+    if (opts.treelet_passes > 0) {
+        optimize_treelets(prims, opts, max_leaf_size, scheduler);
+    } else {
+        m_unoptimized_cost = sah_cost(opts);
+    }
+    if (quantized) {
+        quantize(prims, opts);
+    } else {
+        collapse(opts);
+    }
+}
+
+/**
+ * Count the primitives below each node of a subtree.
+ *
+ * @return Number of primitives below node.
+ */
+static uint32_t count_primitives(const std::vector<bvh_node>& nodes, uint32_t node,
+                                 std::vector<uint32_t>& counts)
+{
+    const bvh_node& n = nodes[node];
+    if (n.is_leaf()) {
+        counts[node] = n.count;
+    } else {
+        counts[node] = count_primitives(nodes, n.offset, counts)
+            + count_primitives(nodes, n.offset + 1, counts);
+    }
+    return counts[node];
+}
+
+/**
+ * Replace the treelet below a node with the arrangement of its leaves which has the lowest SAH
+ * cost. The treelet is grown from the node by repeatedly expanding its largest leaf, and its leaves
+ * may be whole subtrees. Only the surface area of the interior nodes of the treelet depends on its
+ * arrangement, so every arrangement is found by dynamic programming over subsets of the leaves.
+ * The node pairs of the treelet are reused for the new arrangement.
+ */
+static void restructure_treelet(std::vector<bvh_node>& nodes, uint32_t root)
+{
+    const static size_t MAX_LEAVES = TREELET_LEAVES;
+    const static size_t SUBSETS = 1 << MAX_LEAVES;
+    uint32_t leaves[MAX_LEAVES];
+    uint32_t pairs[MAX_LEAVES - 1]; // Child pairs of the interior nodes
+    size_t nleaves = 2, npairs = 1;
+    scalar old_cost = nodes[root].volume.surface_area();
+    leaves[0] = nodes[root].offset;
+    leaves[1] = nodes[root].offset + 1;
+    pairs[0] = nodes[root].offset;
+    while (nleaves < MAX_LEAVES) {
+        int largest = -1;
+        scalar largest_area = -1;
+        for (size_t i = 0; i < nleaves; ++i) {
+            const bvh_node& n = nodes[leaves[i]];
+            if (!n.is_leaf() && n.volume.surface_area() > largest_area) {
+                largest = i;
+                largest_area = n.volume.surface_area();
+            }
+        }
+        if (largest < 0) {
+            break;
+        }
+        uint32_t expanded = leaves[largest];
+        old_cost += largest_area;
+        pairs[npairs++] = nodes[expanded].offset;
+        leaves[largest] = nodes[expanded].offset;
+        leaves[nleaves++] = nodes[expanded].offset + 1;
+    }
+    if (nleaves < 3) {
+        return;
+    }
+    // Find the cheapest arrangement of each subset of leaves, from smaller subsets to larger
+    aabb bounds[SUBSETS];
+    scalar cost[SUBSETS];
+    uint8_t split[SUBSETS];
+    size_t full = (1 << nleaves) - 1;
+    for (size_t mask = 1; mask <= full; ++mask) {
+        bounds[mask] = aabb::empty();
+        for (size_t i = 0; i < nleaves; ++i) {
+            if (mask & (1 << i)) {
+                bounds[mask].extend(nodes[leaves[i]].volume);
+            }
+        }
+        if ((mask & (mask - 1)) == 0) {
+            cost[mask] = 0;
+            continue;
+        }
+        // Only visit partitions holding the lowest leaf on the left, since order doesn't matter
+        size_t lowest = mask & (~mask + 1);
+        cost[mask] = SCALAR_INF;
+        for (size_t left = (mask - 1) & mask; left > 0; left = (left - 1) & mask) {
+            if (!(left & lowest)) {
+                continue;
+            }
+            scalar c = cost[left] + cost[mask ^ left];
+            if (c < cost[mask]) {
+                cost[mask] = c;
+                split[mask] = left;
+            }
+        }
+        cost[mask] += bounds[mask].surface_area();
+    }
+    if (!(cost[full] < old_cost * (1 - TREELET_MIN_GAIN))) {
+        return;
+    }
+    // Rebuild the treelet in place, handing out its node pairs to the new interior nodes
+    bvh_node leaf_nodes[MAX_LEAVES];
+    for (size_t i = 0; i < nleaves; ++i) {
+        leaf_nodes[i] = nodes[leaves[i]];
+    }
+    std::function<void(uint32_t, size_t)> emit = [&](uint32_t node, size_t mask) {
+        if ((mask & (mask - 1)) == 0) {
+            nodes[node] = leaf_nodes[__builtin_ctz(mask)];
+            return;
+        }
+        uint32_t pair = pairs[--npairs];
+        nodes[node].volume = bounds[mask];
+        nodes[node].offset = pair;
+        nodes[node].count = 0;
+        emit(pair, split[mask]);
+        emit(pair + 1, mask ^ split[mask]);
+    };
+    emit(root, full);
+}
+
+/**
+ * Restructure the treelets of a subtree bottom up. Children are optimized before their parent, so
+ * treelets are always formed from already optimized subtrees.
+ */
+static void optimize_subtree(std::vector<bvh_node>& nodes, uint32_t node,
+                             const std::vector<uint32_t>& counts, TaskScheduler *scheduler)
+{
+    if (nodes[node].is_leaf()) {
+        return;
+    }
+    uint32_t left = nodes[node].offset;
+    uint32_t right = left + 1;
+    if (scheduler != nullptr && counts[node] >= PARALLEL_BUILD_THRESHOLD) {
+        TaskGroup subtree(scheduler);
+        subtree.run([&]() {
+                optimize_subtree(nodes, left, counts, scheduler);
+            });
+        optimize_subtree(nodes, right, counts, scheduler);
+        subtree.wait();
+    } else {
+        optimize_subtree(nodes, left, counts, scheduler);
+        optimize_subtree(nodes, right, counts, scheduler);
+    }
+    restructure_treelet(nodes, node);
+}
+
+/**
+ * Find the lowest SAH cost of each subtree, when subtrees of few enough primitives may be gathered
+ * into a single leaf. Costs are not normalized by the area of the root.
+ *
+ * @param make_leaf Set for each node which should become a leaf.
+ * @return Lowest cost of the subtree below node.
+ */
+static scalar find_leaf_collapse(const std::vector<bvh_node>& nodes, uint32_t node,
+                                 const bvh_options& opts, size_t max_leaf_size,
+                                 std::vector<uint32_t>& counts, std::vector<bool>& make_leaf)
+{
+    const bvh_node& n = nodes[node];
+    scalar area = n.volume.surface_area();
+    if (n.is_leaf()) {
+        counts[node] = n.count;
+        make_leaf[node] = true;
+        return area * opts.intersection_cost * n.count;
+    }
+    scalar cost = area * opts.traversal_cost
+        + find_leaf_collapse(nodes, n.offset, opts, max_leaf_size, counts, make_leaf)
+        + find_leaf_collapse(nodes, n.offset + 1, opts, max_leaf_size, counts, make_leaf);
+    counts[node] = counts[n.offset] + counts[n.offset + 1];
+    scalar leaf_cost = area * opts.intersection_cost * counts[node];
+    make_leaf[node] = counts[node] <= max_leaf_size && leaf_cost <= cost;
+    return make_leaf[node] ? leaf_cost : cost;
+}
+
+/**
+ * Append the primitives below a node to a list, in depth first order.
+ */
+static void gather_primitives(const std::vector<bvh_node>& nodes, uint32_t node,
+                              const std::vector<bvh_primitive>& prims,
+                              std::vector<bvh_primitive>& out)
+{
+    const bvh_node& n = nodes[node];
+    if (n.is_leaf()) {
+        out.insert(out.end(), prims.begin() + n.offset, prims.begin() + n.offset + n.count);
+        return;
+    }
+    gather_primitives(nodes, n.offset, prims, out);
+    gather_primitives(nodes, n.offset + 1, prims, out);
+}
+
+/**
+ * Copy a subtree into a new node array, turning the nodes chosen by find_leaf_collapse into leaves.
+ * Primitives are copied into a new list in leaf order.
+ */
+static void emit_leaf_collapse(const std::vector<bvh_node>& nodes, uint32_t node,
+                               const std::vector<bool>& make_leaf,
+                               const std::vector<bvh_primitive>& prims,
+                               std::vector<bvh_node>& out_nodes, uint32_t index,
+                               std::vector<bvh_primitive>& out_prims)
+{
+    const bvh_node& n = nodes[node];
+    out_nodes[index].volume = n.volume;
+    if (make_leaf[node]) {
+        out_nodes[index].offset = out_prims.size();
+        gather_primitives(nodes, node, prims, out_prims);
+        out_nodes[index].count = out_prims.size() - out_nodes[index].offset;
+        return;
+    }
+    uint32_t pair = out_nodes.size();
+    out_nodes.resize(pair + 2);
+    out_nodes[index].offset = pair;
+    out_nodes[index].count = 0;
+    emit_leaf_collapse(nodes, n.offset, make_leaf, prims, out_nodes, pair, out_prims);
+    emit_leaf_collapse(nodes, n.offset + 1, make_leaf, prims, out_nodes, pair + 1, out_prims);
+}
+
+void BVHTree::optimize_treelets(std::vector<bvh_primitive>& prims, const bvh_options& opts,
+                                size_t max_leaf_size, TaskScheduler *scheduler)
+{
+    std::vector<uint32_t> counts(m_nodes.size());
+    std::vector<bool> make_leaf(m_nodes.size());
+    scalar root_area = m_nodes[0].volume.surface_area();
+    scalar cost = find_leaf_collapse(m_nodes, 0, opts, max_leaf_size, counts, make_leaf);
+    m_unoptimized_cost = root_area > 0 ? cost / root_area : 0;
+    for (size_t pass = 0; pass < opts.treelet_passes; ++pass) {
+        count_primitives(m_nodes, 0, counts);
+        optimize_subtree(m_nodes, 0, counts, scheduler);
+    }
+    // Gather small subtrees back into leaves where it lowers the cost
+    find_leaf_collapse(m_nodes, 0, opts, max_leaf_size, counts, make_leaf);
+    std::vector<bvh_node> nodes;
+    std::vector<bvh_primitive> leaf_prims;
+    nodes.reserve(m_nodes.size());
+    leaf_prims.reserve(prims.size());
+    nodes.resize(1);
+    emit_leaf_collapse(m_nodes, 0, make_leaf, prims, nodes, 0, leaf_prims);
+    m_nodes.swap(nodes);
+    prims.swap(leaf_prims);
+}
+
+/**
+ * Find the depth of the deepest leaf of a flattened binary tree. Walks the tree with an explicit
+ * stack, since edited trees may be too deep to recurse through.
+ */
+static size_t tree_depth(const std::vector<bvh_node>& nodes)
+{
+    size_t deepest = 0;
+    std::vector<std::pair<uint32_t, size_t>> pending;
+    if (!nodes.empty()) {
+        pending.emplace_back(0, 0);
+    }
+    while (!pending.empty()) {
+        auto [node, depth] = pending.back();
+        pending.pop_back();
+        deepest = std::max(deepest, depth);
+        if (!nodes[node].is_leaf()) {
+            pending.emplace_back(nodes[node].offset, depth + 1);
+            pending.emplace_back(nodes[node].offset + 1, depth + 1);
+        }
+    }
+    return deepest;
+}
+
+void BVHTree::collapse(const bvh_options& opts)
+{
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_depth = tree_depth(m_nodes);
+    if (m_nodes.empty()) {
+        return;
+    }
+    if (opts.width == 4) {
+        m_nodes4.resize(1);
+        collapse_bvh(m_nodes, 0, m_nodes4, 0);
+    } else if (opts.width == 8) {
+        m_nodes8.resize(1);
+        collapse_bvh(m_nodes, 0, m_nodes8, 0);
+    }
+}
+
+void BVHTree::quantize(std::vector<bvh_primitive>& prims, const bvh_options& opts)
+{
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_qnodes4.clear();
+    m_qnodes8.clear();
+    if (m_nodes.empty()) {
+        return;
+    }
+    m_quantized_cost = sah_cost(opts);
+    m_depth = tree_depth(m_nodes);
+    std::vector<bvh_primitive> quantized_prims;
+    quantized_prims.reserve(prims.size());
+    if (opts.width == 4) {
+        m_qnodes4.reserve(m_nodes.size() / 3 + 1);
+        m_qnodes4.resize(1);
+        quantize_bvh(m_nodes, 0, m_qnodes4, 0, prims, quantized_prims);
+        m_qnodes4.shrink_to_fit();
+    } else {
+        m_qnodes8.reserve(m_nodes.size() / 7 + 1);
+        m_qnodes8.resize(1);
+        quantize_bvh(m_nodes, 0, m_qnodes8, 0, prims, quantized_prims);
+        m_qnodes8.shrink_to_fit();
+    }
+    prims.swap(quantized_prims);
+    std::vector<bvh_node>().swap(m_nodes);
+}
+
+/**
+ * Recompute the bounds of a subtree from the bounds of its primitives, children first.
+ */
+static void refit_subtree(std::vector<bvh_node>& nodes, uint32_t node,
+                          const std::vector<aabb>& prim_bounds)
+{
+    bvh_node& n = nodes[node];
+    n.volume = aabb::empty();
+    if (n.is_leaf()) {
+        for (size_t p = n.offset; p < n.offset + n.count; ++p) {
+            n.volume.extend(prim_bounds[p]);
+        }
+        return;
+    }
+    // Edited trees don't keep children after their parents, so descend rather than walking the
+    // array backwards
+    refit_subtree(nodes, n.offset, prim_bounds);
+    refit_subtree(nodes, n.offset + 1, prim_bounds);
+    n.volume.extend(nodes[n.offset].volume);
+    n.volume.extend(nodes[n.offset + 1].volume);
+}
+
+void BVHTree::refit(const std::vector<aabb>& prim_bounds, const bvh_options& opts)
+{
+    if (!m_nodes.empty()) {
+        refit_subtree(m_nodes, 0, prim_bounds);
+    }
+    collapse(opts);
+}
+
+void BVHTree::build_editable(std::vector<bvh_primitive> prims, const bvh_options& opts)
+{
+    bvh_options binary_opts = opts;
+    binary_opts.width = 2;
+    build(prims, binary_opts, 1);
+    for (auto& n : m_nodes) {
+        if (n.is_leaf()) {
+            n.offset = prims[n.offset].index;
+        }
+    }
+    collapse(opts);
+}
+
+void BVHTree::prepare_edits()
+{
+    m_nodes4.clear();
+    m_nodes8.clear();
+    if (m_parents.size() == m_nodes.size()) {
+        return;
+    }
+    m_parents.assign(m_nodes.size(), NO_NODE);
+    m_leaves.clear();
+    for (uint32_t i = 0; i < m_nodes.size(); ++i) {
+        const bvh_node& n = m_nodes[i];
+        if (n.is_leaf()) {
+            if (m_leaves.size() <= n.offset) {
+                m_leaves.resize(n.offset + 1, NO_NODE);
+            }
+            m_leaves[n.offset] = i;
+        } else {
+            m_parents[n.offset] = i;
+            m_parents[n.offset + 1] = i;
+        }
+    }
+}
+
+void BVHTree::adopt(uint32_t node)
+{
+    const bvh_node& n = m_nodes[node];
+    if (n.is_leaf()) {
+        m_leaves[n.offset] = node;
+    } else {
+        m_parents[n.offset] = node;
+        m_parents[n.offset + 1] = node;
+    }
+}
+
+void BVHTree::refit_ancestors(uint32_t node)
+{
+    for (; node != NO_NODE; node = m_parents[node]) {
+        bvh_node& n = m_nodes[node];
+        if (!n.is_leaf()) {
+            n.volume = m_nodes[n.offset].volume;
+            n.volume.extend(m_nodes[n.offset + 1].volume);
+        }
+    }
+}
+
+void BVHTree::release_pair(uint32_t pair)
+{
+    uint32_t last = m_nodes.size() - 2;
+    if (pair != last) {
+        uint32_t parent = m_parents[last];
+        m_nodes[pair] = m_nodes[last];
+        m_nodes[pair + 1] = m_nodes[last + 1];
+        m_nodes[parent].offset = pair;
+        m_parents[pair] = parent;
+        m_parents[pair + 1] = parent;
+        adopt(pair);
+        adopt(pair + 1);
+    }
+    m_nodes.resize(last);
+    m_parents.resize(last);
+}
+
+void BVHTree::insert(uint32_t prim, const aabb& bounds)
+{
+    prepare_edits();
+    if (m_leaves.size() <= prim) {
+        m_leaves.resize(prim + 1, NO_NODE);
+    }
+    bvh_node leaf;
+    leaf.volume = bounds;
+    leaf.offset = prim;
+    leaf.count = 1;
+    if (m_nodes.empty()) {
+        m_nodes.push_back(leaf);
+        m_parents.push_back(NO_NODE);
+        m_leaves[prim] = 0;
+        return;
+    }
+    // Search for the sibling with the lowest cost, which is the area of the new parent plus the
+    // area added to each ancestor. The area added to ancestors only grows further down the tree,
+    // so subtrees which can't beat the best sibling found so far are skipped.
+    struct candidate {
+        uint32_t node;
+        scalar inherited; // Area added to the ancestors of the node
+
+        bool operator<(const candidate& b) const { return inherited > b.inherited; }
+    };
+    std::priority_queue<candidate> queue;
+    scalar leaf_area = bounds.surface_area();
+    uint32_t best = 0;
+    scalar best_cost = SCALAR_INF;
+    queue.push({0, 0});
+    while (!queue.empty()) {
+        candidate c = queue.top();
+        queue.pop();
+        if (c.inherited + leaf_area >= best_cost) {
+            break;
+        }
+        const bvh_node& n = m_nodes[c.node];
+        aabb merged = n.volume;
+        merged.extend(bounds);
+        scalar direct = merged.surface_area();
+        if (c.inherited + direct < best_cost) {
+            best_cost = c.inherited + direct;
+            best = c.node;
+        }
+        scalar inherited = c.inherited + direct - n.volume.surface_area();
+        if (!n.is_leaf() && inherited + leaf_area < best_cost) {
+            queue.push({n.offset, inherited});
+            queue.push({n.offset + 1, inherited});
+        }
+    }
+    // Move the sibling into a new pair along with the leaf, and put their parent in its place
+    uint32_t pair = m_nodes.size();
+    m_nodes.push_back(m_nodes[best]);
+    m_nodes.push_back(leaf);
+    m_parents.push_back(best);
+    m_parents.push_back(best);
+    adopt(pair);
+    adopt(pair + 1);
+    m_nodes[best].offset = pair;
+    m_nodes[best].count = 0;
+    refit_ancestors(best);
+}
+
+void BVHTree::remove(uint32_t prim)
+{
+    prepare_edits();
+    uint32_t leaf = m_leaves[prim];
+    m_leaves[prim] = NO_NODE;
+    if (leaf == 0) {
+        m_nodes.clear();
+        m_parents.clear();
+        return;
+    }
+    // Move the sibling of the leaf into the place of their parent
+    uint32_t parent = m_parents[leaf];
+    uint32_t pair = m_nodes[parent].offset;
+    uint32_t sibling = leaf == pair ? pair + 1 : pair;
+    m_nodes[parent] = m_nodes[sibling];
+    adopt(parent);
+    refit_ancestors(m_parents[parent]);
+    release_pair(pair);
+}
+
+void BVHTree::rename(uint32_t from, uint32_t to)
+{
+    prepare_edits();
+    if (m_leaves.size() <= to) {
+        m_leaves.resize(to + 1, NO_NODE);
+    }
+    uint32_t leaf = m_leaves[from];
+    m_leaves[from] = NO_NODE;
+    m_leaves[to] = leaf;
+    m_nodes[leaf].offset = to;
+}
+
+void BVHTree::commit_edits(const bvh_options& opts)
+{
+    if (m_nodes4.empty() && m_nodes8.empty()) {
+        collapse(opts);
+    }
+}
+
+void BVHTree::visit_leaves(const std::function<void(uint32_t first, uint32_t count)>& fn) const
+{
+    // Leaves never share primitives, so ordering them by their first primitive is enough
+    std::vector<std::pair<uint32_t, uint32_t>> leaves;
+    for (auto& n : m_nodes) {
+        if (n.is_leaf()) {
+            leaves.emplace_back(n.offset, n.count);
+        }
+    }
+    auto add_wide = [&](const auto& nodes) {
+        for (auto& n : nodes) {
+            for (size_t i = 0; i < sizeof(n.child) / sizeof(n.child[0]); ++i) {
+                if (n.child[i] != std::decay_t<decltype(n)>::EMPTY && n.count[i] > 0) {
+                    leaves.emplace_back(n.child[i], n.count[i]);
+                }
+            }
+        }
+    };
+    auto add_quantized = [&](const auto& nodes) {
+        for (auto& n : nodes) {
+            uint32_t next_prim = n.prim_base;
+            for (size_t i = 0; i < sizeof(n.meta) && n.meta[i] != std::decay_t<decltype(n)>::EMPTY;
+                    ++i) {
+                if (n.meta[i] > 0) {
+                    leaves.emplace_back(next_prim, n.meta[i]);
+                    next_prim += n.meta[i];
+                }
+            }
+        }
+    };
+    if (m_nodes.empty()) {
+        add_wide(m_nodes4);
+        add_wide(m_nodes8);
+        add_quantized(m_qnodes4);
+        add_quantized(m_qnodes8);
+    }
+    std::sort(leaves.begin(), leaves.end());
+    for (auto& leaf : leaves) {
+        fn(leaf.first, leaf.second);
+    }
+}
+
+size_t BVHTree::memory_usage() const
+{
+    return m_nodes.capacity() * sizeof(bvh_node)
+        + m_nodes4.capacity() * sizeof(bvh_wide_node<4>)
+        + m_nodes8.capacity() * sizeof(bvh_wide_node<8>)
+        + m_qnodes4.capacity() * sizeof(bvh_quantized_node<4>)
+        + m_qnodes8.capacity() * sizeof(bvh_quantized_node<8>)
+        + (m_parents.capacity() + m_leaves.capacity()) * sizeof(uint32_t);
+}
+
+scalar BVHTree::sah_cost(const bvh_options& opts) const
+{
+    if (m_nodes.empty()) {
+        return m_quantized_cost;
+    }
+    scalar root_area = m_nodes[0].volume.surface_area();
+    if (!(root_area > 0)) {
+        return 0;
+    }
+    scalar cost = 0;
+    for (auto& n : m_nodes) {
+        scalar area = n.volume.surface_area() / root_area;
+        if (n.is_leaf()) {
+            cost += area * opts.intersection_cost * n.count;
+        } else {
+            cost += area * opts.traversal_cost;
+        }
+    }
+    return cost;
+}
+
+/**
+ * Stack of nodes left to visit by a traversal of an N wide tree. Each node visited pushes at most N
+ * children, and the N - 1 not visited next stay on the stack below them. So the stack never holds
+ * more than (N - 1) * depth + 1 entries, and the fixed size array covers every tree up to
+ * TRAVERSAL_MAX_DEPTH without allocating. Deeper trees, such as a top level unbalanced by many
+ * edits, spill the remaining entries to the heap.
+ */
+template <typename T, size_t N>
+class TraversalStack {
+    private:
+
+        const static size_t CAPACITY = (N - 1) * TRAVERSAL_MAX_DEPTH + 1;
+
+        T m_entries[CAPACITY];
+        size_t m_size;
+        std::vector<T> m_overflow;
+
+    public:
+
+        TraversalStack() : m_size(0) {}
+
+        bool empty() const { return m_size == 0; }
+
+        void push(const T& entry)
+        {
+            if (m_size < CAPACITY) {
+                m_entries[m_size] = entry;
+            } else {
+                m_overflow.push_back(entry);
+            }
+            ++m_size;
+        }
+
+        T pop()
+        {
+            --m_size;
+            if (m_size < CAPACITY) {
+                return m_entries[m_size];
+            }
+            T entry = m_overflow.back();
+            m_overflow.pop_back();
+            return entry;
+        }
+};
+
+/**
+ * Traverse a flattened binary BVH front to back. The nearer child of each node is visited first,
+ * unless any hit will do.
+ */
+template <bool AnyHit, typename LeafFn>
+static void traverse_binary(const std::vector<bvh_node>& nodes, const traversal_ray& r,
+                            const scalar& closest, LeafFn visit_leaf, traversal_stats *stats)
+{
+    struct stack_entry {
+        uint32_t node;
+        scalar dist;
+    };
+    if (nodes.empty()) {
+        return;
+    }
+    scalar root_dist;
+    if (stats != nullptr) {
+        stats->boxes_tested++;
+    }
+    if (!r.intersect_aabb(nodes[0].volume, closest, root_dist)) {
+        return;
+    }
+    TraversalStack<stack_entry, 2> to_search;
+    to_search.push({0, root_dist});
+    while (!to_search.empty()) {
+        stack_entry top = to_search.pop();
+        if (top.dist > closest) {
+            // Node lies beyond the closest intersection found since it was pushed
+            continue;
+        }
+        const bvh_node& n = nodes[top.node];
+        if (stats != nullptr) {
+            stats->nodes_visited++;
+            stats->boxes_tested += n.is_leaf() ? 0 : 2;
+        }
+        if (n.is_leaf()) {
+            if (visit_leaf(n.offset, n.count) && AnyHit) {
+                return;
+            }
+            continue;
+        }
+        scalar left, right;
+        bool hit_left = r.intersect_aabb(nodes[n.offset].volume, closest, left);
+        bool hit_right = r.intersect_aabb(nodes[n.offset + 1].volume, closest, right);
+        if (hit_left && hit_right) {
+            // Push the far child first, so the near child is searched first
+            if (AnyHit || left <= right) {
+                to_search.push({n.offset + 1, right});
+                to_search.push({n.offset, left});
+            } else {
+                to_search.push({n.offset, left});
+                to_search.push({n.offset + 1, right});
+            }
+        } else if (hit_left) {
+            to_search.push({n.offset, left});
+        } else if (hit_right) {
+            to_search.push({n.offset + 1, right});
+        }
+    }
+}
+
+/**
+ * Single precision ray, prepared for slab tests against wide nodes.
+ */
+struct wide_ray {
+    float origin[3];
+    float inv_dir[3];
+    float tmin;
+
+    wide_ray(const traversal_ray& r) :
+        tmin(round_down(r.tmin))
+    {
+        for (int c = 0; c < 3; ++c) {
+            origin[c] = (float)r.origin[c];
+            inv_dir[c] = (float)r.inv_dir[c];
+        }
+    }
+};
+
+/** Single precision SLAB_FAR_SCALE, for slab tests against wide nodes */
+const static float WIDE_SLAB_FAR_SCALE = 1 + 2 * (3 * std::numeric_limits<float>::epsilon() / 2)
+    / (1 - 3 * std::numeric_limits<float>::epsilon() / 2);
+
+/**
+ * Intersect a ray against every child of a wide node at once.
+ *
+ * @param tmax Children entered beyond this distance are not reported.
+ * @param dist Receives the entry distance of each child.
+ * @return Bitmask of the children entered by the ray. Empty slots may be included.
+ */
+template <size_t N>
+static inline unsigned int intersect_wide_node(const bvh_wide_node<N>& node, const wide_ray& r,
+                                               float tmax, float *dist)
+{
+#if defined(__AVX__)
+    if constexpr (N == 8) {
+        __m256 tnear = _mm256_set1_ps(r.tmin);
+        __m256 tfar = _mm256_set1_ps(tmax);
+        for (int c = 0; c < 3; ++c) {
+            __m256 o = _mm256_set1_ps(r.origin[c]);
+            __m256 id = _mm256_set1_ps(r.inv_dir[c]);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds_min[c]), o), id);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.bounds_max[c]), o), id);
+            tnear = _mm256_max_ps(tnear, _mm256_min_ps(t0, t1));
+            tfar = _mm256_min_ps(tfar, _mm256_max_ps(t0, t1));
+        }
+        _mm256_storeu_ps(dist, tnear);
+        tfar = _mm256_mul_ps(tfar, _mm256_set1_ps(WIDE_SLAB_FAR_SCALE));
+        return _mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+    }
+#endif
+#if defined(__SSE2__)
+    unsigned int mask = 0;
+    for (size_t g = 0; g < N; g += 4) {
+        __m128 tnear = _mm_set1_ps(r.tmin);
+        __m128 tfar = _mm_set1_ps(tmax);
+        for (int c = 0; c < 3; ++c) {
+            __m128 o = _mm_set1_ps(r.origin[c]);
+            __m128 id = _mm_set1_ps(r.inv_dir[c]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_min[c] + g), o), id);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_max[c] + g), o), id);
+            tnear = _mm_max_ps(tnear, _mm_min_ps(t0, t1));
+            tfar = _mm_min_ps(tfar, _mm_max_ps(t0, t1));
+        }
+        _mm_storeu_ps(dist + g, tnear);
+        tfar = _mm_mul_ps(tfar, _mm_set1_ps(WIDE_SLAB_FAR_SCALE));
+        mask |= _mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) << g;
+    }
+    return mask;
+#else
+    unsigned int mask = 0;
+    for (size_t i = 0; i < N; ++i) {
+        float tnear = r.tmin, tfar = tmax;
+        for (int c = 0; c < 3; ++c) {
+            float t0 = (node.bounds_min[c][i] - r.origin[c]) * r.inv_dir[c];
+            float t1 = (node.bounds_max[c][i] - r.origin[c]) * r.inv_dir[c];
+            tnear = std::max(tnear, std::min(t0, t1));
+            tfar = std::min(tfar, std::max(t0, t1));
+        }
+        dist[i] = tnear;
+        if (tnear <= tfar * WIDE_SLAB_FAR_SCALE) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Traverse a wide BVH front to back. Children of each node are tested together, and visited
+ * nearest first unless any hit will do.
+ */
+template <bool AnyHit, size_t N, typename LeafFn>
+static void traverse_wide(const std::vector<bvh_wide_node<N>>& nodes, const traversal_ray& r,
+                          const scalar& closest, LeafFn visit_leaf, traversal_stats *stats)
+{
+    struct stack_entry {
+        uint32_t child;
+        uint32_t count;
+        scalar dist;
+    };
+    if (nodes.empty()) {
+        return;
+    }
+    wide_ray wr(r);
+    TraversalStack<stack_entry, N> to_search;
+    to_search.push({0, 0, 0});
+    while (!to_search.empty()) {
+        stack_entry top = to_search.pop();
+        if (top.dist > closest) {
+            // Node lies beyond the closest intersection found since it was pushed
+            continue;
+        }
+        if (stats != nullptr) {
+            stats->nodes_visited++;
+        }
+        if (top.count > 0) {
+            if (visit_leaf(top.child, top.count) && AnyHit) {
+                return;
+            }
+            continue;
+        }
+        const bvh_wide_node<N>& n = nodes[top.child];
+        alignas(32) float dist[N];
+        unsigned int mask = intersect_wide_node(n, wr, round_up(closest), dist);
+        // Sort entered children far to near, so the nearest ends up on top of the stack
+        stack_entry hits[N];
+        size_t nhits = 0;
+        size_t tested = 0;
+        for (size_t i = 0; i < N && n.child[i] != bvh_wide_node<N>::EMPTY; ++i, ++tested) {
+            if (!(mask & (1u << i))) {
+                continue;
+            }
+            stack_entry e = {n.child[i], n.count[i], dist[i]};
+            if (AnyHit) {
+                // The first hit ends the traversal, so children can be visited in any order
+                to_search.push(e);
+                continue;
+            }
+            size_t j = nhits++;
+            while (j > 0 && hits[j - 1].dist < e.dist) {
+                hits[j] = hits[j - 1];
+                --j;
+            }
+            hits[j] = e;
+        }
+        for (size_t i = 0; i < nhits; ++i) {
+            to_search.push(hits[i]);
+        }
+        if (stats != nullptr) {
+            stats->boxes_tested += tested;
+        }
+    }
+}
+
+/**
+ * Decode the child bounds of a quantized node into single precision.
+ */
+template <size_t N>
+static inline void decode_quantized_node(const bvh_quantized_node<N>& n, bvh_wide_node<N>& decoded)
+{
+    for (int c = 0; c < 3; ++c) {
+        float scale = quantized_scale(n.exponent[c]);
+#if defined(__SSE2__)
+        __m128 o = _mm_set1_ps(n.origin[c]);
+        __m128 s = _mm_set1_ps(scale);
+        __m128i zero = _mm_setzero_si128();
+        for (size_t g = 0; g < N; g += 4) {
+            int32_t qmin, qmax;
+            std::memcpy(&qmin, n.qmin[c] + g, sizeof(qmin));
+            std::memcpy(&qmax, n.qmax[c] + g, sizeof(qmax));
+            __m128i wmin = _mm_unpacklo_epi16(
+                    _mm_unpacklo_epi8(_mm_cvtsi32_si128(qmin), zero), zero);
+            __m128i wmax = _mm_unpacklo_epi16(
+                    _mm_unpacklo_epi8(_mm_cvtsi32_si128(qmax), zero), zero);
+            _mm_store_ps(decoded.bounds_min[c] + g,
+                    _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(wmin), s)));
+            _mm_store_ps(decoded.bounds_max[c] + g,
+                    _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(wmax), s)));
+        }
+#else
+        for (size_t i = 0; i < N; ++i) {
+            decoded.bounds_min[c][i] = dequantize(n.origin[c], n.qmin[c][i], scale);
+            decoded.bounds_max[c][i] = dequantize(n.origin[c], n.qmax[c][i], scale);
+        }
+#endif
+    }
+}
+
+/**
+ * Traverse a quantized wide BVH front to back, like traverse_wide. Each node is decoded into single
+ * precision bounds before its children are tested, so the slab tests are shared with the
+ * unquantized tree.
+ */
+template <bool AnyHit, size_t N, typename LeafFn>
+static void traverse_quantized(const std::vector<bvh_quantized_node<N>>& nodes,
+                               const traversal_ray& r, const scalar& closest, LeafFn visit_leaf,
+                               traversal_stats *stats)
+{
+    struct stack_entry {
+        uint32_t child;
+        uint32_t count;
+        scalar dist;
+    };
+    if (nodes.empty()) {
+        return;
+    }
+    wide_ray wr(r);
+    TraversalStack<stack_entry, N> to_search;
+    to_search.push({0, 0, 0});
+    while (!to_search.empty()) {
+        stack_entry top = to_search.pop();
+        if (top.dist > closest) {
+            // Node lies beyond the closest intersection found since it was pushed
+            continue;
+        }
+        if (stats != nullptr) {
+            stats->nodes_visited++;
+        }
+        if (top.count > 0) {
+            if (visit_leaf(top.child, top.count) && AnyHit) {
+                return;
+            }
+            continue;
+        }
+        const bvh_quantized_node<N>& n = nodes[top.child];
+        bvh_wide_node<N> decoded;
+        decode_quantized_node(n, decoded);
+        alignas(32) float dist[N];
+        unsigned int mask = intersect_wide_node(decoded, wr, round_up(closest), dist);
+        // Sort entered children far to near, so the nearest ends up on top of the stack
+        stack_entry hits[N];
+        size_t nhits = 0;
+        uint32_t next_child = n.child_base;
+        uint32_t next_prim = n.prim_base;
+        size_t tested = 0;
+        for (size_t i = 0; i < N && n.meta[i] != bvh_quantized_node<N>::EMPTY; ++i, ++tested) {
+            stack_entry e = {n.meta[i] > 0 ? next_prim : next_child, n.meta[i], dist[i]};
+            if (n.meta[i] > 0) {
+                next_prim += n.meta[i];
+            } else {
+                ++next_child;
+            }
+            if (!(mask & (1u << i))) {
+                continue;
+            }
+            if (AnyHit) {
+                to_search.push(e);
+                continue;
+            }
+            size_t j = nhits++;
+            while (j > 0 && hits[j - 1].dist < e.dist) {
+                hits[j] = hits[j - 1];
+                --j;
+            }
+            hits[j] = e;
+        }
+        for (size_t i = 0; i < nhits; ++i) {
+            to_search.push(hits[i]);
+        }
+        if (stats != nullptr) {
+            stats->boxes_tested += tested;
+        }
+    }
+}
+
+template <bool AnyHit, typename LeafFn>
+void BVHTree::traverse(const Ray& r, const scalar& closest, LeafFn visit_leaf,
+                       traversal_stats *stats) const
+{
+    traversal_ray tr(r);
+    if (!m_qnodes8.empty()) {
+        traverse_quantized<AnyHit>(m_qnodes8, tr, closest, visit_leaf, stats);
+    } else if (!m_qnodes4.empty()) {
+        traverse_quantized<AnyHit>(m_qnodes4, tr, closest, visit_leaf, stats);
+    } else if (!m_nodes8.empty()) {
+        traverse_wide<AnyHit>(m_nodes8, tr, closest, visit_leaf, stats);
+    } else if (!m_nodes4.empty()) {
+        traverse_wide<AnyHit>(m_nodes4, tr, closest, visit_leaf, stats);
+    } else {
+        traverse_binary<AnyHit>(m_nodes, tr, closest, visit_leaf, stats);
+    }
+}
+
+/**
+ * Add an interior node to the statistics of a tree.
+ *
+ * @param kids Bounds of the children of the node.
+ * @param area Surface area of the node, relative to the root.
+ */
+static void record_interior(bvh_stats& stats, const aabb *kids, size_t nkids, scalar area,
+                            const bvh_options& opts)
+{
+    stats.interior_nodes++;
+    stats.children += nkids;
+    stats.sah_cost += area * opts.traversal_cost;
+    aabb parent = aabb::empty();
+    for (size_t i = 0; i < nkids; ++i) {
+        parent.extend(kids[i]);
+    }
+    scalar parent_area = parent.surface_area();
+    if (!(parent_area > 0)) {
+        return;
+    }
+    scalar shared = 0;
+    for (size_t i = 0; i < nkids; ++i) {
+        for (size_t j = i + 1; j < nkids; ++j) {
+            aabb both;
+            both.min = glm::max(kids[i].min, kids[j].min);
+            both.max = glm::min(kids[i].max, kids[j].max);
+            shared += both.surface_area();
+        }
+    }
+    stats.overlap += shared / parent_area;
+}
+
+/**
+ * Add a leaf to the statistics of a tree.
+ *
+ * @param area Surface area of the leaf, relative to the root.
+ */
+static void record_leaf(bvh_stats& stats, size_t depth, size_t count, scalar area,
+                        const bvh_options& opts)
+{
+    stats.leaves++;
+    stats.references += count;
+    stats.sah_cost += area * opts.intersection_cost * count;
+    if (stats.leaf_depths.size() <= depth) {
+        stats.leaf_depths.resize(depth + 1);
+    }
+    stats.leaf_depths[depth]++;
+    if (stats.leaf_sizes.size() <= count) {
+        stats.leaf_sizes.resize(count + 1);
+    }
+    stats.leaf_sizes[count]++;
+}
+
+/**
+ * Gather the statistics of a subtree of a flattened binary BVH.
+ */
+static void binary_stats(const std::vector<bvh_node>& nodes, uint32_t node, size_t depth,
+                         scalar root_area, const bvh_options& opts, bvh_stats& stats)
+{
+    const bvh_node& n = nodes[node];
+    scalar area = n.volume.surface_area() / root_area;
+    if (n.is_leaf()) {
+        record_leaf(stats, depth, n.count, area, opts);
+        return;
+    }
+    aabb kids[2] = { nodes[n.offset].volume, nodes[n.offset + 1].volume };
+    record_interior(stats, kids, 2, area, opts);
+    binary_stats(nodes, n.offset, depth + 1, root_area, opts, stats);
+    binary_stats(nodes, n.offset + 1, depth + 1, root_area, opts, stats);
+}
+
+/**
+ * Decode a quantized node into a full wide node, including its child references.
+ */
+template <size_t N>
+static void expand_quantized_node(const bvh_quantized_node<N>& n, bvh_wide_node<N>& wide)
+{
+    decode_quantized_node(n, wide);
+    uint32_t next_child = n.child_base;
+    uint32_t next_prim = n.prim_base;
+    for (size_t i = 0; i < N; ++i) {
+        if (n.meta[i] == bvh_quantized_node<N>::EMPTY) {
+            wide.child[i] = bvh_wide_node<N>::EMPTY;
+            wide.count[i] = 0;
+        } else if (n.meta[i] > 0) {
+            wide.child[i] = next_prim;
+            wide.count[i] = n.meta[i];
+            next_prim += n.meta[i];
+        } else {
+            wide.child[i] = next_child++;
+            wide.count[i] = 0;
+        }
+    }
+}
+
+/**
+ * Gather the statistics of a subtree of a wide BVH.
+ *
+ * @param get_node Gets a node of the tree by index, as a bvh_wide_node.
+ * @param area Surface area of the node, relative to the root.
+ * @param root_area Surface area of the root, to which child areas are made relative.
+ */
+template <size_t N, typename NodeFn>
+static void wide_stats(NodeFn get_node, uint32_t node, size_t depth, scalar area,
+                       scalar root_area, const bvh_options& opts, bvh_stats& stats)
+{
+    bvh_wide_node<N> n = get_node(node);
+    aabb kids[N];
+    size_t nkids = 0;
+    for (; nkids < N && n.child[nkids] != bvh_wide_node<N>::EMPTY; ++nkids) {
+        for (int c = 0; c < 3; ++c) {
+            kids[nkids].min[c] = n.bounds_min[c][nkids];
+            kids[nkids].max[c] = n.bounds_max[c][nkids];
+        }
+    }
+    record_interior(stats, kids, nkids, area, opts);
+    for (size_t i = 0; i < nkids; ++i) {
+        scalar child_area = kids[i].surface_area() / root_area;
+        if (n.count[i] > 0) {
+            record_leaf(stats, depth + 1, n.count[i], child_area, opts);
+        } else {
+            wide_stats<N>(get_node, n.child[i], depth + 1, child_area, root_area, opts, stats);
+        }
+    }
+}
+
+/**
+ * Gather the statistics of a wide BVH from its root.
+ */
+template <size_t N, typename NodeFn>
+static void wide_tree_stats(NodeFn get_node, const bvh_options& opts, bvh_stats& stats)
+{
+    bvh_wide_node<N> root = get_node(0);
+    aabb box = aabb::empty();
+    for (size_t i = 0; i < N && root.child[i] != bvh_wide_node<N>::EMPTY; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            box.min[c] = std::min<scalar>(box.min[c], root.bounds_min[c][i]);
+            box.max[c] = std::max<scalar>(box.max[c], root.bounds_max[c][i]);
+        }
+    }
+    scalar root_area = box.surface_area();
+    if (root_area > 0) {
+        wide_stats<N>(get_node, 0, 0, 1, root_area, opts, stats);
+    }
+}
+
+bvh_stats BVHTree::stats(const bvh_options& opts) const
+{
+    bvh_stats stats;
+    if (!m_qnodes8.empty()) {
+        wide_tree_stats<8>([this](uint32_t i) {
+                bvh_wide_node<8> n;
+                expand_quantized_node(m_qnodes8[i], n);
+                return n;
+            }, opts, stats);
+    } else if (!m_qnodes4.empty()) {
+        wide_tree_stats<4>([this](uint32_t i) {
+                bvh_wide_node<4> n;
+                expand_quantized_node(m_qnodes4[i], n);
+                return n;
+            }, opts, stats);
+    } else if (!m_nodes8.empty()) {
+        wide_tree_stats<8>([this](uint32_t i) { return m_nodes8[i]; }, opts, stats);
+    } else if (!m_nodes4.empty()) {
+        wide_tree_stats<4>([this](uint32_t i) { return m_nodes4[i]; }, opts, stats);
+    } else if (!m_nodes.empty() && m_nodes[0].volume.surface_area() > 0) {
+        binary_stats(m_nodes, 0, 0, m_nodes[0].volume.surface_area(), opts, stats);
+    }
+    if (stats.interior_nodes > 0) {
+        stats.overlap /= stats.interior_nodes;
+    }
+    return stats;
+}
+
+/**
+ * Packet of rays prepared for slab tests against wide nodes. Rays are stored in structure of arrays
+ * form, so every ray of the packet is tested against a child at once. The interval each component
+ * spans across the packet is kept as well, bounding the slab distances of all rays at once.
+ */
+struct alignas(32) packet_ray {
+    float origin[3][RAY_PACKET_SIZE];
+    float inv_dir[3][RAY_PACKET_SIZE];
+    float tmin[RAY_PACKET_SIZE];
+    float origin_lo[3], origin_hi[3];
+    float inv_dir_lo[3], inv_dir_hi[3];
+    float tmin_lo;
+
+    /**
+     * @param lanes Bitmask of the rays of the packet in use. Unused lanes copy a used one, so they
+     * never widen the intervals.
+     */
+    packet_ray(const ray_packet& packet, uint32_t lanes);
+};
+
+packet_ray::packet_ray(const ray_packet& packet, uint32_t lanes)
+{
+    size_t first = __builtin_ctz(lanes);
+    for (size_t i = 0; i < RAY_PACKET_SIZE; ++i) {
+        traversal_ray tr(packet.rays[(lanes & (1u << i)) ? i : first]);
+        wide_ray wr(tr);
+        for (int c = 0; c < 3; ++c) {
+            origin[c][i] = wr.origin[c];
+            inv_dir[c][i] = wr.inv_dir[c];
+        }
+        tmin[i] = wr.tmin;
+    }
+    for (int c = 0; c < 3; ++c) {
+        origin_lo[c] = *std::min_element(origin[c], origin[c] + RAY_PACKET_SIZE);
+        origin_hi[c] = *std::max_element(origin[c], origin[c] + RAY_PACKET_SIZE);
+        inv_dir_lo[c] = *std::min_element(inv_dir[c], inv_dir[c] + RAY_PACKET_SIZE);
+        inv_dir_hi[c] = *std::max_element(inv_dir[c], inv_dir[c] + RAY_PACKET_SIZE);
+    }
+    tmin_lo = *std::min_element(tmin, tmin + RAY_PACKET_SIZE);
+}
+
+/**
+ * Bound the products of any two values from a pair of intervals. Rounding is monotonic, so the
+ * bounds hold for the rounded products as well.
+ */
+static inline void interval_mul(float a_lo, float a_hi, float b_lo, float b_hi, float& lo,
+                                float& hi)
+{
+    float p0 = a_lo * b_lo;
+    float p1 = a_lo * b_hi;
+    float p2 = a_hi * b_lo;
+    float p3 = a_hi * b_hi;
+    lo = std::min(std::min(p0, p1), std::min(p2, p3));
+    hi = std::max(std::max(p0, p1), std::max(p2, p3));
+}
+
+/**
+ * Test whether any ray of a packet may enter a child of a wide node, from the intervals spanned by
+ * the packet alone. Conservative, so rays of a packet passing the test still need testing one lane
+ * each.
+ *
+ * @param tmax Children entered beyond this distance by every ray are culled.
+ * @param tnear Receives a lower bound of the distance any ray enters the child.
+ */
+template <size_t N>
+static inline bool packet_may_enter(const bvh_wide_node<N>& n, size_t i, const packet_ray& r,
+                                    float tmax, float& tnear)
+{
+    float tfar = tmax;
+    tnear = r.tmin_lo;
+    for (int c = 0; c < 3; ++c) {
+        float lo0, hi0, lo1, hi1;
+        interval_mul(n.bounds_min[c][i] - r.origin_hi[c], n.bounds_min[c][i] - r.origin_lo[c],
+                r.inv_dir_lo[c], r.inv_dir_hi[c], lo0, hi0);
+        interval_mul(n.bounds_max[c][i] - r.origin_hi[c], n.bounds_max[c][i] - r.origin_lo[c],
+                r.inv_dir_lo[c], r.inv_dir_hi[c], lo1, hi1);
+        // Either plane may be the near one, unless the directions agree in sign
+        tnear = std::max(tnear, std::min(lo0, lo1));
+        tfar = std::min(tfar, std::max(hi0, hi1));
+    }
+    return tnear <= tfar * WIDE_SLAB_FAR_SCALE;
+}
+
+/**
+ * Intersect the rays of a packet against a child of a wide node, one lane each. Rounds exactly
+ * like intersect_wide_node, so a ray enters the same children whether traced alone or in a packet.
+ *
+ * @param tmax Distance of each ray beyond which children are not reported.
+ * @param lanes Bitmask of the rays to test.
+ * @return Bitmask of the rays entering the child.
+ */
+template <size_t N>
+static inline uint32_t intersect_packet_child(const bvh_wide_node<N>& n, size_t i,
+                                              const packet_ray& r, const float *tmax,
+                                              uint32_t lanes)
+{
+    uint32_t mask = 0;
+#if defined(__AVX__)
+    for (size_t g = 0; g < RAY_PACKET_SIZE; g += 8) {
+        if (((lanes >> g) & 0xff) == 0) {
+            continue;
+        }
+        __m256 tnear = _mm256_load_ps(r.tmin + g);
+        __m256 tfar = _mm256_load_ps(tmax + g);
+        for (int c = 0; c < 3; ++c) {
+            __m256 o = _mm256_load_ps(r.origin[c] + g);
+            __m256 id = _mm256_load_ps(r.inv_dir[c] + g);
+            __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(n.bounds_min[c][i]), o), id);
+            __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(n.bounds_max[c][i]), o), id);
+            tnear = _mm256_max_ps(tnear, _mm256_min_ps(t0, t1));
+            tfar = _mm256_min_ps(tfar, _mm256_max_ps(t0, t1));
+        }
+        tfar = _mm256_mul_ps(tfar, _mm256_set1_ps(WIDE_SLAB_FAR_SCALE));
+        mask |= (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ)) << g;
+    }
+#elif defined(__SSE2__)
+    for (size_t g = 0; g < RAY_PACKET_SIZE; g += 4) {
+        if (((lanes >> g) & 0xf) == 0) {
+            continue;
+        }
+        __m128 tnear = _mm_load_ps(r.tmin + g);
+        __m128 tfar = _mm_load_ps(tmax + g);
+        for (int c = 0; c < 3; ++c) {
+            __m128 o = _mm_load_ps(r.origin[c] + g);
+            __m128 id = _mm_load_ps(r.inv_dir[c] + g);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.bounds_min[c][i]), o), id);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(n.bounds_max[c][i]), o), id);
+            tnear = _mm_max_ps(tnear, _mm_min_ps(t0, t1));
+            tfar = _mm_min_ps(tfar, _mm_max_ps(t0, t1));
+        }
+        tfar = _mm_mul_ps(tfar, _mm_set1_ps(WIDE_SLAB_FAR_SCALE));
+        mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) << g;
+    }
+#else
+    for (uint32_t m = lanes; m != 0; m &= m - 1) {
+        size_t l = __builtin_ctz(m);
+        float tnear = r.tmin[l], tfar = tmax[l];
+        for (int c = 0; c < 3; ++c) {
+            float t0 = (n.bounds_min[c][i] - r.origin[c][l]) * r.inv_dir[c][l];
+            float t1 = (n.bounds_max[c][i] - r.origin[c][l]) * r.inv_dir[c][l];
+            tnear = std::max(tnear, std::min(t0, t1));
+            tfar = std::min(tfar, std::max(t0, t1));
+        }
+        if (tnear <= tfar * WIDE_SLAB_FAR_SCALE) {
+            mask |= 1u << l;
+        }
+    }
+#endif
+    return mask & lanes;
+}
+
+/**
+ * Traverse a wide BVH front to back with a packet of rays. Each entry on the stack carries the rays
+ * entering it, and children are visited in order of the nearest distance any of those rays may
+ * enter them.
+ *
+ * @param get_node Gets a node of the tree by index, as a bvh_wide_node.
+ */
+template <size_t N, typename NodeFn, typename LeafFn>
+static void traverse_packet_wide(NodeFn get_node, const packet_ray& r, uint32_t lanes,
+                                 const scalar *closest, LeafFn visit_leaf,
+                                 traversal_stats *stats)
+{
+    struct stack_entry {
+        uint32_t child;
+        uint32_t count;
+        uint32_t lanes;
+        float dist;
+    };
+    TraversalStack<stack_entry, N> to_search;
+    to_search.push({0, 0, lanes, -std::numeric_limits<float>::infinity()});
+    alignas(32) float tmax[RAY_PACKET_SIZE];
+    std::fill(tmax, tmax + RAY_PACKET_SIZE, -std::numeric_limits<float>::infinity());
+    while (!to_search.empty()) {
+        stack_entry top = to_search.pop();
+        // Rays whose closest intersection, found since the node was pushed, lies before any ray
+        // enters the node are dropped
+        uint32_t active = 0;
+        float packet_tmax = -std::numeric_limits<float>::infinity();
+        for (uint32_t m = top.lanes; m != 0; m &= m - 1) {
+            size_t l = __builtin_ctz(m);
+            if (top.dist <= closest[l]) {
+                active |= 1u << l;
+                tmax[l] = round_up(closest[l]);
+                packet_tmax = std::max(packet_tmax, tmax[l]);
+            }
+        }
+        if (active == 0) {
+            continue;
+        }
+        if (stats != nullptr) {
+            stats->nodes_visited++;
+        }
+        if (top.count > 0) {
+            visit_leaf(top.child, top.count, active);
+            continue;
+        }
+        const bvh_wide_node<N>& n = get_node(top.child);
+        // Sort entered children far to near, so the nearest ends up on top of the stack
+        stack_entry hits[N];
+        size_t nhits = 0;
+        size_t tested = 0;
+        for (size_t i = 0; i < N && n.child[i] != bvh_wide_node<N>::EMPTY; ++i, ++tested) {
+            float tnear;
+            if (!packet_may_enter(n, i, r, packet_tmax, tnear)) {
+                continue;
+            }
+            uint32_t entered = intersect_packet_child(n, i, r, tmax, active);
+            if (entered == 0) {
+                continue;
+            }
+            stack_entry e = {n.child[i], n.count[i], entered, tnear};
+            size_t j = nhits++;
+            while (j > 0 && hits[j - 1].dist < e.dist) {
+                hits[j] = hits[j - 1];
+                --j;
+            }
+            hits[j] = e;
+        }
+        for (size_t i = 0; i < nhits; ++i) {
+            to_search.push(hits[i]);
+        }
+        if (stats != nullptr) {
+            stats->boxes_tested += tested;
+        }
+    }
+}
+
+/**
+ * View a node of a binary BVH as a wide node with two children, for packet traversal. A leaf is
+ * viewed as a node with itself as its only child, so a tree with a leaf for a root is traversed
+ * like any other.
+ */
+static bvh_wide_node<2> binary_as_wide(const std::vector<bvh_node>& nodes, uint32_t node)
+{
+    bvh_wide_node<2> wide;
+    uint32_t kids[2] = {node, bvh_wide_node<2>::EMPTY};
+    if (!nodes[node].is_leaf()) {
+        kids[0] = nodes[node].offset;
+        kids[1] = nodes[node].offset + 1;
+    }
+    for (size_t i = 0; i < 2; ++i) {
+        if (kids[i] == bvh_wide_node<2>::EMPTY) {
+            for (int c = 0; c < 3; ++c) {
+                wide.bounds_min[c][i] = std::numeric_limits<float>::infinity();
+                wide.bounds_max[c][i] = -std::numeric_limits<float>::infinity();
+            }
+            wide.child[i] = bvh_wide_node<2>::EMPTY;
+            wide.count[i] = 0;
+            continue;
+        }
+        const bvh_node& k = nodes[kids[i]];
+        for (int c = 0; c < 3; ++c) {
+            wide.bounds_min[c][i] = round_down(k.volume.min[c]);
+            wide.bounds_max[c][i] = round_up(k.volume.max[c]);
+        }
+        wide.child[i] = k.is_leaf() ? k.offset : kids[i];
+        wide.count[i] = k.count;
+    }
+    return wide;
+}
+
+template <typename LeafFn>
+void BVHTree::traverse_packet(const ray_packet& packet, uint32_t lanes, const scalar *closest,
+                              LeafFn visit_leaf, traversal_stats *stats) const
+{
+    if (empty() || lanes == 0) {
+        return;
+    }
+    packet_ray r(packet, lanes);
+    if (!m_qnodes8.empty()) {
+        traverse_packet_wide<8>([this](uint32_t i) {
+                bvh_wide_node<8> n;
+                expand_quantized_node(m_qnodes8[i], n);
+                return n;
+            }, r, lanes, closest, visit_leaf, stats);
+    } else if (!m_qnodes4.empty()) {
+        traverse_packet_wide<4>([this](uint32_t i) {
+                bvh_wide_node<4> n;
+                expand_quantized_node(m_qnodes4[i], n);
+                return n;
+            }, r, lanes, closest, visit_leaf, stats);
+    } else if (!m_nodes8.empty()) {
+        traverse_packet_wide<8>([this](uint32_t i) -> const bvh_wide_node<8>& {
+                return m_nodes8[i];
+            }, r, lanes, closest, visit_leaf, stats);
+    } else if (!m_nodes4.empty()) {
+        traverse_packet_wide<4>([this](uint32_t i) -> const bvh_wide_node<4>& {
+                return m_nodes4[i];
+            }, r, lanes, closest, visit_leaf, stats);
+    } else {
+        traverse_packet_wide<2>([this](uint32_t i) { return binary_as_wide(m_nodes, i); },
+                r, lanes, closest, visit_leaf, stats);
+    }
+}
+
+/**
+ * Log the statistics of a tree.
+ */
+static void log_bvh_stats(const std::string& name, const bvh_stats& stats)
+{
+    std::cout << "BVH report: " << name << std::endl;
+    std::cout << "\tNodes: " << stats.interior_nodes << " interior, " << stats.leaves
+        << " leaves, " << stats.references << " references" << std::endl;
+    if (stats.interior_nodes > 0) {
+        std::cout << "\tMean children per node: "
+            << (scalar)stats.children / stats.interior_nodes << std::endl;
+    }
+    std::cout << "\tSAH cost: " << stats.sah_cost << std::endl;
+    std::cout << "\tSibling overlap: " << stats.overlap << std::endl;
+    size_t depth_sum = 0, min_depth = stats.leaf_depths.size();
+    std::cout << "\tLeaf depths:";
+    for (size_t d = 0; d < stats.leaf_depths.size(); ++d) {
+        if (stats.leaf_depths[d] > 0) {
+            std::cout << ' ' << d << ':' << stats.leaf_depths[d];
+            depth_sum += d * stats.leaf_depths[d];
+            min_depth = std::min(min_depth, d);
+        }
+    }
+    std::cout << std::endl;
+    if (stats.leaves > 0) {
+        std::cout << "\tDepth: min " << min_depth << ", mean " << (scalar)depth_sum / stats.leaves
+            << ", max " << stats.leaf_depths.size() - 1 << std::endl;
+    }
+    std::cout << "\tLeaf sizes:";
+    for (size_t n = 0; n < stats.leaf_sizes.size(); ++n) {
+        if (stats.leaf_sizes[n] > 0) {
+            std::cout << ' ' << n << ':' << stats.leaf_sizes[n];
+        }
+    }
+    std::cout << std::endl;
+    if (stats.leaves > 0) {
+        std::cout << "\tMean leaf size: " << (scalar)stats.references / stats.leaves << std::endl;
+    }
+}
+
+MeshBVH::MeshBVH(const Mesh& mesh, const bvh_options& opts, TaskScheduler *scheduler) :
+    m_mesh(&mesh)
+{
+    std::vector<bvh_primitive> prims;
+    prims.reserve(mesh.faces().size());
+    for (auto& tri : mesh.triangles()) {
+        aabb bounds = aabb::empty();
+        bounds.extend(vec3(tri.p0()));
+        bounds.extend(vec3(tri.p1()));
+        bounds.extend(vec3(tri.p2()));
+        prims.emplace_back(bounds, prims.size());
+    }
+    auto clip = [&mesh](const bvh_primitive& ref, int axis, scalar plane, aabb& left, aabb& right) {
+        Mesh::Triangle tri(&mesh, ref.index);
+        vec3 v[3] = { vec3(tri.p0()), vec3(tri.p1()), vec3(tri.p2()) };
+        left = aabb::empty();
+        right = aabb::empty();
+        for (int i = 0; i < 3; ++i) {
+            const vec3& a = v[i];
+            const vec3& b = v[(i + 1) % 3];
+            if (a[axis] <= plane) {
+                left.extend(a);
+            }
+            if (a[axis] >= plane) {
+                right.extend(a);
+            }
+            if ((a[axis] < plane && b[axis] > plane) || (a[axis] > plane && b[axis] < plane)) {
+                vec3 p = glm::mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+                p[axis] = plane;
+                left.extend(p);
+                right.extend(p);
+            }
+        }
+        // The reference may already have been clipped, so stay within its bounds
+        left.min = glm::max(left.min, ref.bounds.min);
+        left.max = glm::min(left.max, ref.bounds.max);
+        right.min = glm::max(right.min, ref.bounds.min);
+        right.max = glm::min(right.max, ref.bounds.max);
+    };
+    m_tree.build(prims, opts, opts.max_leaf_size, scheduler, clip);
+    m_faces.reserve(prims.size());
+    for (auto& p : prims) {
+        m_faces.push_back(p.index);
+    }
+    // Gather the triangles of each leaf into packets
+    auto& records = mesh.triangle_records();
+    m_leaf_packets.resize(m_faces.size());
+    m_tree.visit_leaves([&](uint32_t first, uint32_t count) {
+            m_leaf_packets[first] = m_packets.size();
+            for (uint32_t done = 0; done < count; done += TRIANGLE_PACKET_SIZE) {
+                triangle_packet packet;
+                for (size_t i = 0; i < TRIANGLE_PACKET_SIZE; ++i) {
+                    uint32_t face = m_faces[first + done + (done + i < count ? i : 0)];
+                    const Mesh::triangle_record& rec = records[face];
+                    for (int c = 0; c < 3; ++c) {
+                        packet.p0[c][i] = rec.p0[c];
+                        packet.p1[c][i] = rec.p1[c];
+                        packet.p2[c][i] = rec.p2[c];
+                    }
+                    packet.face[i] = face;
+                }
+                m_packets.push_back(packet);
+            }
+        });
+    m_packets.shrink_to_fit();
+}
+
+size_t MeshBVH::memory_usage() const
+{
+    return m_tree.memory_usage()
+        + (m_faces.capacity() + m_leaf_packets.capacity()) * sizeof(uint32_t)
+        + m_packets.capacity() * sizeof(triangle_packet);
+}
+
+scalar MeshBVH::sah_cost(const bvh_options& opts) const
+{
+    return m_tree.sah_cost(opts);
+}
+
+bool MeshBVH::trace_ray(const Ray& r, trace_info& info, traversal_stats *stats) const
+{
+    bool hit = false;
+    watertight_ray wr(r);
+    m_tree.traverse(r, info.distance, [&](uint32_t first, uint32_t count) {
+            if (stats != nullptr) {
+                stats->triangles_tested += count;
+            }
+            bool leaf_hit = false;
+            const triangle_packet *packet = &m_packets[m_leaf_packets[first]];
+            for (uint32_t done = 0; done < count; done += TRIANGLE_PACKET_SIZE, ++packet) {
+                size_t n = std::min<size_t>(count - done, TRIANGLE_PACKET_SIZE);
+                if (r.intersect_triangles(*packet, n, *m_mesh, wr, info)) {
+                    leaf_hit = true;
+                }
+            }
+            hit = hit || leaf_hit;
+            return leaf_hit;
+        }, stats);
+    return hit;
+}
+
+uint32_t MeshBVH::trace_packet(const ray_packet& packet, uint32_t lanes, trace_info *info,
+                               traversal_stats *stats) const
+{
+    uint32_t hits = 0;
+    scalar closest[RAY_PACKET_SIZE];
+    watertight_ray wr[RAY_PACKET_SIZE];
+    for (uint32_t m = lanes; m != 0; m &= m - 1) {
+        size_t l = __builtin_ctz(m);
+        closest[l] = info[l].distance;
+        wr[l] = watertight_ray(packet.rays[l]);
+    }
+    m_tree.traverse_packet(packet, lanes, closest, [&](uint32_t first, uint32_t count,
+                                                       uint32_t active) {
+            for (uint32_t m = active; m != 0; m &= m - 1) {
+                size_t l = __builtin_ctz(m);
+                if (stats != nullptr) {
+                    stats->triangles_tested += count;
+                }
+                const triangle_packet *tris = &m_packets[m_leaf_packets[first]];
+                for (uint32_t done = 0; done < count; done += TRIANGLE_PACKET_SIZE, ++tris) {
+                    size_t n = std::min<size_t>(count - done, TRIANGLE_PACKET_SIZE);
+                    if (packet.rays[l].intersect_triangles(*tris, n, *m_mesh, wr[l], info[l])) {
+                        closest[l] = info[l].distance;
+                        hits |= 1u << l;
+                    }
+                }
+            }
+        }, stats);
+    return hits;
+}
+
+bool MeshBVH::occluded(const Ray& r, traversal_stats *stats) const
+{
+    bool hit = false;
+    watertight_ray wr(r);
+    m_tree.traverse<true>(r, r.tmax, [&](uint32_t first, uint32_t count) {
+            const triangle_packet *packet = &m_packets[m_leaf_packets[first]];
+            for (uint32_t done = 0; done < count; done += TRIANGLE_PACKET_SIZE, ++packet) {
+                size_t n = std::min<size_t>(count - done, TRIANGLE_PACKET_SIZE);
+                if (stats != nullptr) {
+                    stats->triangles_tested += n;
+                }
+                if (r.intersect_any(*packet, n, *m_mesh, wr)) {
+                    hit = true;
+                    break;
+                }
+            }
+            return hit;
+        }, stats);
+    return hit;
+}
+
+uint32_t MeshBVH::occluded_packet(const ray_packet& packet, uint32_t lanes,
+                                  traversal_stats *stats) const
+{
+    uint32_t blocked = 0;
+    scalar closest[RAY_PACKET_SIZE];
+    watertight_ray wr[RAY_PACKET_SIZE];
+    for (uint32_t m = lanes; m != 0; m &= m - 1) {
+        size_t l = __builtin_ctz(m);
+        closest[l] = packet.rays[l].tmax;
+        wr[l] = watertight_ray(packet.rays[l]);
+    }
+    m_tree.traverse_packet(packet, lanes, closest, [&](uint32_t first, uint32_t count,
+                                                       uint32_t active) {
+            for (uint32_t m = active; m != 0; m &= m - 1) {
+                size_t l = __builtin_ctz(m);
+                const triangle_packet *tris = &m_packets[m_leaf_packets[first]];
+                for (uint32_t done = 0; done < count; done += TRIANGLE_PACKET_SIZE, ++tris) {
+                    size_t n = std::min<size_t>(count - done, TRIANGLE_PACKET_SIZE);
+                    if (stats != nullptr) {
+                        stats->triangles_tested += n;
+                    }
+                    if (packet.rays[l].intersect_any(*tris, n, *m_mesh, wr[l])) {
+                        // Blocked rays cull every node left, so they drop out of the traversal
+                        blocked |= 1u << l;
+                        closest[l] = -SCALAR_INF;
+                        break;
+                    }
+                }
+            }
+        }, stats);
+    return blocked;
+}
+
+BVH::BVH(const Scene& scene_graph, const bvh_options& opts, TaskScheduler *scheduler) :
+    m_opts(opts),
+    m_scheduler(scheduler),
+    m_edits(0)
+{
+    // The top level is refit and edited in place, which quantized nodes don't allow
+    m_opts.quantize = false;
+    auto start_time = std::chrono::steady_clock::now();
+    // Build one BVH per mesh, shared by all instances of that mesh. Largest meshes are started
+    // first, so a single huge mesh doesn't end up building alone at the end.
+    auto& meshes = scene_graph.mesh_list();
+    std::vector<size_t> build_order(meshes.size());
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        build_order[i] = i;
+    }
+    std::sort(build_order.begin(), build_order.end(), [&](size_t a, size_t b) {
+            return meshes[a].faces().size() > meshes[b].faces().size();
+        });
+    m_mesh_bvhs.resize(meshes.size());
+    parallel_for(scheduler, meshes.size(), 1, [&](size_t i) {
+            size_t m = build_order[i];
+            m_mesh_bvhs[m] = std::make_unique<MeshBVH>(meshes[m], opts, scheduler);
+        });
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        std::cout << "BVH: Mesh " << std::quoted(meshes[i].name()) << " ("
+            << meshes[i].faces().size() << " triangles) SAH cost "
+            << m_mesh_bvhs[i]->sah_cost(opts);
+        if (opts.treelet_passes > 0) {
+            std::cout << " (" << m_mesh_bvhs[i]->unoptimized_sah_cost()
+                << " before treelet optimization)";
+        }
+        if (m_mesh_bvhs[i]->reference_count() != meshes[i].faces().size()) {
+            std::cout << ", " << m_mesh_bvhs[i]->reference_count() << " references";
+        }
+        if (m_mesh_bvhs[i]->depth() > TRAVERSAL_MAX_DEPTH) {
+            std::cout << ", " << m_mesh_bvhs[i]->depth()
+                << " levels deep so traversals may allocate";
+        }
+        std::cout << std::endl;
+    }
+    std::vector<mat4> instance_xforms;
+    std::vector<size_t> instance_meshes;
+    gather_instances(scene_graph.assimp_scene()->mRootNode, MAT4_IDENTITY, nullptr, 0,
+            instance_xforms, instance_meshes, m_instance_xform_ids);
+    std::cout << "BVH: Instanced " << instance_xforms.size() << " meshes from scene graph"
+        << std::endl;
+    m_instances.reserve(instance_xforms.size());
+    m_instance_bvhs.reserve(instance_xforms.size());
+    m_instance_slots.reserve(instance_xforms.size());
+    m_slot_handles.reserve(instance_xforms.size());
+    for (size_t i = 0; i < instance_xforms.size(); ++i) {
+        m_instances.push_back(std::make_unique<MeshInstance>(meshes[instance_meshes[i]],
+                    instance_xforms[i]));
+        m_instance_bvhs.push_back(m_mesh_bvhs[instance_meshes[i]].get());
+        m_instance_slots.push_back(i);
+        m_slot_handles.push_back(i);
+    }
+    m_next_xform_id = (uint32_t)instance_xforms.size();
+    std::vector<bvh_primitive> prims(m_instances.size(), bvh_primitive(aabb::empty(), 0));
+    parallel_for(scheduler, m_instances.size(), INSTANCE_BOUNDS_GRAIN, [&](size_t i) {
+            prims[i] = bvh_primitive(aabb(*m_instances[i]), i);
+        });
+    if (opts.report) {
+        for (auto& p : prims) {
+            std::cout << "\tAABB Extents:"
+                << " min=" << glm::to_string(p.bounds.min)
+                << " max=" << glm::to_string(p.bounds.max)
+                << std::endl;
+        }
+    }
+    build_top_level(prims);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    std::cout << "BVH: Built in " << elapsed.count() << "s using "
+        << (scheduler != nullptr ? scheduler->concurrency() : 1)
+        << " threads" << std::endl;
+    size_t memory = m_tree.memory_usage();
+    for (auto& mesh_bvh : m_mesh_bvhs) {
+        memory += mesh_bvh->memory_usage();
+    }
+    std::cout << "BVH: Using " << (memory + 512) / 1024 << " KiB";
+    if (opts.quantize) {
+        std::cout << " with quantized mesh BVH nodes";
+    }
+    std::cout << std::endl;
+    if (opts.report) {
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            log_bvh_stats("Mesh \"" + meshes[i].name() + "\"", m_mesh_bvhs[i]->stats(opts));
+        }
+        log_bvh_stats("Top level", m_tree.stats(m_opts));
+    }
+    std::cout << "BVH: Top level SAH cost " << m_built_cost;
+    if (opts.treelet_passes > 0) {
+        std::cout << " (" << m_tree.unoptimized_sah_cost() << " before treelet optimization)";
+    }
+    if (m_tree.depth() > TRAVERSAL_MAX_DEPTH) {
+        std::cout << ", " << m_tree.depth() << " levels deep so traversals may allocate";
+    }
+    std::cout << std::endl;
+}
+
+void BVH::build_top_level(std::vector<bvh_primitive>& prims)
+{
+    m_tree.build(prims, m_opts, 1, m_scheduler);
+    m_built_cost = sah_cost(m_opts);
+    // Store instances in leaf order
+    std::vector<std::unique_ptr<MeshInstance>> instances;
+    std::vector<const MeshBVH*> instance_bvhs;
+    std::vector<uint32_t> instance_xform_ids;
+    std::vector<size_t> slot_handles;
+    instances.reserve(prims.size());
+    instance_bvhs.reserve(prims.size());
+    instance_xform_ids.reserve(prims.size());
+    slot_handles.reserve(prims.size());
+    for (size_t i = 0; i < prims.size(); ++i) {
+        instances.push_back(std::move(m_instances[prims[i].index]));
+        instance_bvhs.push_back(m_instance_bvhs[prims[i].index]);
+        instance_xform_ids.push_back(m_instance_xform_ids[prims[i].index]);
+        slot_handles.push_back(m_slot_handles[prims[i].index]);
+        m_instance_slots[slot_handles.back()] = i;
+    }
+    m_instances.swap(instances);
+    m_instance_bvhs.swap(instance_bvhs);
+    m_instance_xform_ids.swap(instance_xform_ids);
+    m_slot_handles.swap(slot_handles);
+}
+
+void BVH::update(const Scene& scene_graph, const SceneAnimation& animation, double time)
+{
+    auto start_time = std::chrono::steady_clock::now();
+    // The refit below regenerates the wide tree, so edits needn't be committed first
+    apply_optimization(true);
+    std::vector<mat4> instance_xforms;
+    std::vector<size_t> instance_meshes;
+    std::vector<uint32_t> instance_xform_ids;
+    gather_instances(scene_graph.assimp_scene()->mRootNode, MAT4_IDENTITY, &animation, time,
+            instance_xforms, instance_meshes, instance_xform_ids);
+    std::vector<aabb> bounds(m_instances.size());
+    parallel_for(m_scheduler, m_instances.size(), INSTANCE_BOUNDS_GRAIN, [&](size_t slot) {
+            // Instances inserted after the BVH was built aren't animated
+            size_t handle = m_slot_handles[slot];
+            if (handle < instance_xforms.size()) {
+                m_instances[slot]->set_transform(instance_xforms[handle]);
+                m_instance_xform_ids[slot] = instance_xform_ids[handle];
+            }
+            bounds[slot] = aabb(*m_instances[slot]);
+        });
+    m_tree.refit(bounds, m_opts);
+    scalar cost = sah_cost(m_opts);
+    bool rebuilt = false;
+    if (cost > m_built_cost * m_opts.rebuild_threshold) {
+        std::vector<bvh_primitive> prims;
+        prims.reserve(bounds.size());
+        for (size_t i = 0; i < bounds.size(); ++i) {
+            prims.emplace_back(bounds[i], i);
+        }
+        build_top_level(prims);
+        rebuilt = true;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    if (rebuilt) {
+        std::cout << "BVH: Refit SAH cost " << cost << " exceeded the limit, rebuilt top level in "
+            << elapsed.count() << "s (SAH cost " << m_built_cost << ")" << std::endl;
+    } else {
+        std::cout << "BVH: Refit top level in " << elapsed.count() << "s (SAH cost " << cost
+            << ")" << std::endl;
+    }
+}
+
+void BVH::edit_tree(const tree_edit& edit)
+{
+    switch (edit.type) {
+        case tree_edit::Insert:
+            m_tree.insert(edit.prim, edit.bounds);
+            break;
+        case tree_edit::Remove:
+            m_tree.remove(edit.prim);
+            break;
+        case tree_edit::Rename:
+            m_tree.rename(edit.prim, edit.to);
+            break;
+    }
+    if (m_optimized.valid()) {
+        m_pending_edits.push_back(edit);
+    }
+}
+
+void BVH::schedule_optimization()
+{
+    apply_optimization(false);
+    m_edits++;
+    if (!(m_opts.reoptimize_fraction > 0) || m_optimized.valid()
+            || m_edits < std::max<size_t>(MIN_REOPTIMIZE_EDITS,
+                m_instances.size() * m_opts.reoptimize_fraction)) {
+        return;
+    }
+    m_edits = 0;
+    std::vector<bvh_primitive> prims;
+    prims.reserve(m_instances.size());
+    for (size_t i = 0; i < m_instances.size(); ++i) {
+        prims.emplace_back(aabb(*m_instances[i]), i);
+    }
+    m_optimized = std::async(std::launch::async,
+            [prims = std::move(prims), opts = m_opts]() mutable {
+                BVHTree tree;
+                tree.build_editable(std::move(prims), opts);
+                return tree;
+            });
+}
+
+void BVH::apply_optimization(bool wait)
+{
+    if (!m_optimized.valid()) {
+        return;
+    }
+    if (!wait && m_optimized.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+        return;
+    }
+    BVHTree tree = m_optimized.get();
+    std::swap(m_tree, tree);
+    for (auto& edit : m_pending_edits) {
+        edit_tree(edit);
+    }
+    m_pending_edits.clear();
+    // Incremental edits may have done better than the rebuild, in which case it is dropped
+    scalar old_cost = tree.sah_cost(m_opts);
+    scalar new_cost = sah_cost(m_opts);
+    if (new_cost > old_cost) {
+        std::swap(m_tree, tree);
+        return;
+    }
+    m_built_cost = new_cost;
+    std::cout << "BVH: Re-optimized top level, SAH cost " << old_cost << " -> " << new_cost
+        << std::endl;
+}
+
+void BVH::commit_edits()
+{
+    apply_optimization(false);
+    m_tree.commit_edits(m_opts);
+}
+
+void BVH::finish_optimization()
+{
+    apply_optimization(true);
+    m_tree.commit_edits(m_opts);
+}
+
+size_t BVH::insert_instance(size_t mesh, const mat4& xform)
+{
+    if (mesh >= m_mesh_bvhs.size()) {
+        throw std::out_of_range("No such mesh in scene");
+    }
+    size_t slot = m_instances.size();
+    size_t handle = m_instance_slots.size();
+    m_instances.push_back(std::make_unique<MeshInstance>(m_mesh_bvhs[mesh]->mesh(), xform));
+    m_instance_bvhs.push_back(m_mesh_bvhs[mesh].get());
+    m_instance_xform_ids.push_back(m_next_xform_id++);
+    m_instance_slots.push_back(slot);
+    m_slot_handles.push_back(handle);
+    edit_tree({tree_edit::Insert, (uint32_t)slot, 0, aabb(*m_instances[slot])});
+    schedule_optimization();
+    return handle;
+}
+
+void BVH::remove_instance(size_t handle)
+{
+    if (handle >= m_instance_slots.size() || m_instance_slots[handle] == NO_INSTANCE) {
+        throw std::out_of_range("No such instance in BVH");
+    }
+    size_t slot = m_instance_slots[handle];
+    size_t last = m_instances.size() - 1;
+    edit_tree({tree_edit::Remove, (uint32_t)slot, 0, aabb()});
+    // Fill the gap with the last instance
+    if (slot != last) {
+        m_instances[slot] = std::move(m_instances[last]);
+        m_instance_bvhs[slot] = m_instance_bvhs[last];
+        m_instance_xform_ids[slot] = m_instance_xform_ids[last];
+        m_slot_handles[slot] = m_slot_handles[last];
+        m_instance_slots[m_slot_handles[slot]] = slot;
+        edit_tree({tree_edit::Rename, (uint32_t)last, (uint32_t)slot, aabb()});
+    }
+    m_instances.pop_back();
+    m_instance_bvhs.pop_back();
+    m_instance_xform_ids.pop_back();
+    m_slot_handles.pop_back();
+    m_instance_slots[handle] = NO_INSTANCE;
+    schedule_optimization();
+}
+
+void BVH::move_instance(size_t handle, const mat4& xform)
+{
+    if (handle >= m_instance_slots.size() || m_instance_slots[handle] == NO_INSTANCE) {
+        throw std::out_of_range("No such instance in BVH");
+    }
+    size_t slot = m_instance_slots[handle];
+    m_instances[slot]->set_transform(xform);
+    // The instance no longer shares the transform of its scene graph node
+    m_instance_xform_ids[slot] = m_next_xform_id++;
+    edit_tree({tree_edit::Remove, (uint32_t)slot, 0, aabb()});
+    edit_tree({tree_edit::Insert, (uint32_t)slot, 0, aabb(*m_instances[slot])});
+    schedule_optimization();
+}
+
+scalar BVH::sah_cost(const bvh_options& opts) const
+{
+    return m_tree.sah_cost(opts);
+}
+
+trace_info BVH::trace_ray(const Ray& r, traversal_stats *stats) const
+{
+    trace_info info;
+    info.intersect_type = IntersectionType::None;
+    info.hitobj = nullptr;
+    info.distance = r.tmax;
+    if (stats != nullptr) {
+        stats->rays++;
+    }
+    ObjectRayCache object_rays(r);
+    m_tree.traverse(r, info.distance, [&](uint32_t first, uint32_t count) {
+            bool hit = false;
+            for (size_t i = first; i < first + count; ++i) {
+                const Ray& local = object_rays.object_ray(*m_instances[i], m_instance_xform_ids[i]);
+                trace_info temp = r.intersect_mesh(*m_instances[i], *m_instance_bvhs[i], local,
+                        info.distance, stats);
+                if (temp.hitobj != nullptr && temp.distance < info.distance) {
+                    info = temp;
+                    hit = true;
+                }
+            }
+            return hit;
+        }, stats);
+    return info;
+}
+
+void BVH::trace_packet(const ray_packet& packet, trace_info *info, traversal_stats *stats) const
+{
+    if (!packet.coherent()) {
+        for (size_t l = 0; l < packet.count; ++l) {
+            info[l] = trace_ray(packet.rays[l], stats);
+        }
+        return;
+    }
+    uint32_t lanes = (1u << packet.count) - 1;
+    scalar closest[RAY_PACKET_SIZE];
+    for (size_t l = 0; l < packet.count; ++l) {
+        info[l].intersect_type = IntersectionType::None;
+        info[l].hitobj = nullptr;
+        info[l].distance = packet.rays[l].tmax;
+        closest[l] = info[l].distance;
+    }
+    if (stats != nullptr) {
+        stats->rays += packet.count;
+    }
+    m_tree.traverse_packet(packet, lanes, closest, [&](uint32_t first, uint32_t count,
+                                                       uint32_t active) {
+            for (size_t i = first; i < first + count; ++i) {
+                const MeshInstance& obj = *m_instances[i];
+                auto& to_obj = obj.inverse_transform();
+                auto& to_world = obj.transform();
+                // Every ray of the packet moves into the space of the instance, so the mesh BVH is
+                // traversed once for all of them
+                ray_packet local;
+                local.count = packet.count;
+                trace_info temp[RAY_PACKET_SIZE];
+                for (uint32_t m = active; m != 0; m &= m - 1) {
+                    size_t l = __builtin_ctz(m);
+                    const Ray& r = packet.rays[l];
+                    local.rays[l] = Ray(to_obj * r.origin, to_obj * r.dir, r.tmin, r.tmax);
+                    temp[l].intersect_type = IntersectionType::None;
+                    temp[l].distance = closest[l];
+                }
+                uint32_t hit = m_instance_bvhs[i]->trace_packet(local, active, temp, stats);
+                for (uint32_t m = hit; m != 0; m &= m - 1) {
+                    size_t l = __builtin_ctz(m);
+                    info[l] = temp[l];
+                    info[l].hitobj = &obj;
+                    info[l].hitpos = to_world * temp[l].hitpos;
+                    info[l].hitnorm = glm::normalize(to_world * temp[l].hitnorm);
+                    closest[l] = info[l].distance;
+                }
+            }
+        }, stats);
+}
+
+bool BVH::occluded(const Ray& r, traversal_stats *stats) const
+{
+    if (stats != nullptr) {
+        stats->rays++;
+    }
+    bool hit = false;
+    ObjectRayCache object_rays(r);
+    m_tree.traverse<true>(r, r.tmax, [&](uint32_t first, uint32_t count) {
+            for (size_t i = first; i < first + count && !hit; ++i) {
+                const Ray& local = object_rays.object_ray(*m_instances[i], m_instance_xform_ids[i]);
+                hit = m_instance_bvhs[i]->occluded(local, stats);
+            }
+            return hit;
+        }, stats);
+    return hit;
+}
+
+uint32_t BVH::occluded_packet(const ray_packet& packet, traversal_stats *stats) const
+{
+    uint32_t blocked = 0;
+    if (!packet.coherent()) {
+        for (size_t l = 0; l < packet.count; ++l) {
+            if (occluded(packet.rays[l], stats)) {
+                blocked |= 1u << l;
+            }
+        }
+        return blocked;
+    }
+    uint32_t lanes = (1u << packet.count) - 1;
+    scalar closest[RAY_PACKET_SIZE];
+    for (size_t l = 0; l < packet.count; ++l) {
+        closest[l] = packet.rays[l].tmax;
+    }
+    if (stats != nullptr) {
+        stats->rays += packet.count;
+    }
+    m_tree.traverse_packet(packet, lanes, closest, [&](uint32_t first, uint32_t count,
+                                                       uint32_t active) {
+            for (size_t i = first; i < first + count; ++i) {
+                uint32_t open = active & ~blocked;
+                if (open == 0) {
+                    break;
+                }
+                auto& to_obj = m_instances[i]->inverse_transform();
+                ray_packet local;
+                local.count = packet.count;
+                for (uint32_t m = open; m != 0; m &= m - 1) {
+                    size_t l = __builtin_ctz(m);
+                    const Ray& r = packet.rays[l];
+                    local.rays[l] = Ray(to_obj * r.origin, to_obj * r.dir, r.tmin, r.tmax);
+                }
+                uint32_t hit = m_instance_bvhs[i]->occluded_packet(local, open, stats);
+                for (uint32_t m = hit; m != 0; m &= m - 1) {
+                    closest[__builtin_ctz(m)] = -SCALAR_INF;
+                }
+                blocked |= hit;
+            }
+        }, stats);
+    return blocked;
 }
 
 BVNode::BVNode(aabb volume, std::shared_ptr<BVNode> left, std::shared_ptr<BVNode> right) :
     m_volume(volume),
-    m_obj(nullptr),
+    m_first(0),
+    m_count(0),
     m_left(left),
     m_right(right) {}
 
-BVNode::BVNode(aabb volume, std::unique_ptr<MeshInstance>& obj) :
+BVNode::BVNode(aabb volume, size_t first, size_t count) :
     m_volume(volume),
-    m_obj(std::move(obj)) {}
+    m_first(first),
+    m_count(count) {}
@@ -27,6 +27,9 @@
 #include "scene.h"
 #include <memory>
 #include <vector>
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <glm/vec3.hpp>
 #include <glm/mat4x4.hpp>
 #include <assimp/scene.h>
@@ -34,45 +37,680 @@
 
 struct trace_info;
 class Ray;
+struct ray_packet;
+class SceneAnimation;
 
 class BVNode;
 
+/**
+ * Strategy used to partition primitives when building a BVH.
+ */
+enum struct BVHSplitMethod {
+    Median, /// Split at the median centroid along the longest axis.
+    SAH, /// Binned surface area heuristic.
+    LBVH, /// Split along a Morton curve through the primitive centroids. Fast to build.
+    SBVH, /// Binned surface area heuristic, also allowing primitives to be split between children.
+};
+
+struct bvh_options {
+
+    /**
+     * Construct with default BVH build options.
+     */
+    bvh_options();
+
+    BVHSplitMethod split_method;
+    size_t max_leaf_size; // Maximum number of triangles in a mesh BVH leaf
+    size_t sah_bins; // Number of bins evaluated per axis by the SAH builder
+    scalar traversal_cost; // Relative cost of testing a ray against a node
+    scalar intersection_cost; // Relative cost of testing a ray against a primitive
+    size_t width; // Branching factor of the traversal tree (2, 4 or 8)
+    bool lbvh_refine; // Rebuild the levels above Morton code clusters of an LBVH with SAH
+    scalar sbvh_budget; // Extra primitive references an SBVH may create, relative to the input
+    scalar sbvh_overlap; // Overlap of object split children, relative to the root area, above
+                         // which an SBVH tries spatial splits
+    scalar rebuild_threshold; // Rebuild the top level when refitting raises its SAH cost past this
+                              // multiple of the cost at the last build
+    scalar reoptimize_fraction; // Rebuild the top level in the background once this fraction of its
+                                // instances were edited incrementally, 0 to never rebuild
+    size_t treelet_passes; // Number of treelet restructuring passes run after building, 0 to skip
+    bool quantize; // Store the wide tree of mesh BVHs with quantized child bounds
+    bool report; // Log quality statistics of each tree once the BVH is built
+};
+
+class TaskScheduler;
+
+/**
+ * Quality statistics of a tree, measured over the nodes used for traversal. Depths count the
+ * nodes above a leaf, so children of the root are at depth 1.
+ */
+struct bvh_stats {
+    size_t interior_nodes;
+    size_t leaves;
+    size_t children; // Child slots in use across all interior nodes
+    size_t references; // Primitive references held by leaves
+    std::vector<size_t> leaf_depths; // Number of leaves at each depth
+    std::vector<size_t> leaf_sizes; // Number of leaves holding each number of primitives
+    scalar sah_cost;
+    scalar overlap; // Mean surface area shared by pairs of siblings, relative to their parent
+
+    bvh_stats();
+};
+
+/**
+ * Work done by traversals, for measuring how a tree performs on the rays of a render. Counters of
+ * separate threads are added together afterwards.
+ */
+struct traversal_stats {
+    uint64_t rays;
+    uint64_t nodes_visited; // Interior nodes and leaves entered
+    uint64_t boxes_tested; // Child bounding volumes tested against a ray
+    uint64_t triangles_tested;
+
+    traversal_stats();
+
+    traversal_stats& operator+=(const traversal_stats& other);
+};
+
+/**
+ * Reference to a primitive during BVH construction.
+ */
+struct bvh_primitive {
+    aabb bounds;
+    size_t index; // Index of the primitive in the owning container
+
+    bvh_primitive(const aabb& bounds, size_t index) :
+        bounds(bounds), index(index) {}
+};
+
+/**
+ * Clips a primitive reference at an axis aligned plane, for spatial split builds. The bounds of
+ * the parts of the reference on either side of the plane are returned in left and right. A part
+ * with no extent along the axis is returned as an empty AABB.
+ */
+typedef std::function<void(const bvh_primitive& ref, int axis, scalar plane, aabb& left,
+                           aabb& right)> bvh_split_fn;
+
+/**
+ * Compact BVH node, stored in a flat array in depth first order. Interior nodes store the index of
+ * their first child, and the second child immediately follows it. Leaf nodes store a range of
+ * primitives owned by the containing BVH.
+ */
+struct alignas(32) bvh_node {
+    aabb volume;
+    uint32_t offset; // Index of the first child, or of the first primitive for leaves
+    uint32_t count; // Number of primitives in the leaf, 0 for interior nodes
+
+    bool is_leaf() const { return count > 0; }
+};
+
+#ifndef USE_DOUBLE_PRECISION
+static_assert(sizeof(bvh_node) == 32, "bvh_node should fit in half a cache line");
+#endif
+
+/**
+ * Wide BVH node with N children, collapsed from the binary tree. Child bounds are stored in
+ * structure of arrays form, so a ray can be tested against every child at once with SIMD. Bounds
+ * are always single precision, rounded outwards when built from double precision volumes.
+ */
+template <size_t N>
+struct alignas(32) bvh_wide_node {
+    float bounds_min[3][N];
+    float bounds_max[3][N];
+    uint32_t child[N]; // Index of the child node, or of the first primitive for leaves
+    uint32_t count[N]; // Number of primitives in leaf children, 0 for interior children
+
+    /** Marks a child slot which is not in use */
+    const static uint32_t EMPTY = UINT32_MAX;
+};
+
+/**
+ * Wide BVH node with child bounds quantized to 8 bits per plane, relative to a grid spanning the
+ * node. Grid cells are a power of two in size, so decoding a plane is exact, and bounds are always
+ * rounded outwards. Interior children are stored next to each other in slot order, as are the
+ * primitives of leaf children, so the node only needs the index of the first of each. At 52 bytes
+ * for N = 4 and 80 bytes for N = 8, it is less than half the size of bvh_wide_node.
+ */
+template <size_t N>
+struct bvh_quantized_node {
+    float origin[3]; // Lower corner of the grid
+    uint32_t child_base; // Index of the first interior child
+    uint32_t prim_base; // Index of the first primitive of the first leaf child
+    int8_t exponent[3]; // Cell size along each axis, as a power of two
+    uint8_t meta[N]; // Number of primitives in leaf children, 0 for interior children
+    uint8_t qmin[3][N];
+    uint8_t qmax[3][N];
+
+    /** Marks a child slot which is not in use. Unused slots always follow the used ones. */
+    const static uint8_t EMPTY = UINT8_MAX;
+    /** Largest number of primitives a leaf child can hold */
+    const static size_t MAX_LEAF_SIZE = UINT8_MAX - 1;
+};
+
+static_assert(sizeof(bvh_quantized_node<4>) == 52, "bvh_quantized_node<4> should stay packed");
+static_assert(sizeof(bvh_quantized_node<8>) == 80, "bvh_quantized_node<8> should stay packed");
+
+/**
+ * Deepest tree, counting the root as depth 0, whose traversal never allocates. Deeper trees still
+ * trace correctly, but their traversal stacks may spill to the heap, so builds report them.
+ */
+const static size_t TRAVERSAL_MAX_DEPTH = 64;
+
+/**
+ * Node hierarchy shared by both levels of the BVH. Holds the flattened binary tree, and optionally
+ * a wide tree collapsed from it, which is then used for traversal.
+ */
+class BVHTree {
+    private:
+
+        std::vector<bvh_node> m_nodes;
+        std::vector<bvh_wide_node<4>> m_nodes4;
+        std::vector<bvh_wide_node<8>> m_nodes8;
+        std::vector<bvh_quantized_node<4>> m_qnodes4;
+        std::vector<bvh_quantized_node<8>> m_qnodes8;
+        std::vector<uint32_t> m_parents; // Parent of each node. Only kept once the tree is edited.
+        std::vector<uint32_t> m_leaves; // Leaf node of each primitive. Only kept once the tree is
+                                        // edited.
+        scalar m_unoptimized_cost; // SAH cost before treelet restructuring
+        scalar m_quantized_cost; // SAH cost of the binary tree, kept once it is released
+        size_t m_depth; // Depth of the binary tree when the traversed tree was last made from it
+
+        /**
+         * Regenerate the wide tree from the binary tree, if opts.width asks for one.
+         */
+        void collapse(const bvh_options& opts);
+
+        /**
+         * Replace the binary tree with a quantized wide tree, and reorder the primitive list to
+         * match it. The tree can't be refit or edited afterwards.
+         */
+        void quantize(std::vector<bvh_primitive>& prims, const bvh_options& opts);
+
+        /**
+         * Restructure small treelets throughout the tree to lower its SAH cost. Expects a tree with
+         * a single primitive per leaf. Each pass visits every node bottom up, and replaces the
+         * treelet of up to 7 leaves below it with the arrangement of lowest cost. Disjoint subtrees
+         * are optimized in parallel. Afterwards, subtrees are gathered into leaves wherever that
+         * lowers the cost, and the primitive list is reordered to match.
+         *
+         * @param scheduler Runs disjoint subtrees in parallel. May be null.
+         */
+        void optimize_treelets(std::vector<bvh_primitive>& prims, const bvh_options& opts,
+                               size_t max_leaf_size, TaskScheduler *scheduler);
+
+        /**
+         * Compute the parent and leaf links needed to edit the tree, if they aren't already known.
+         * The wide tree is dropped, since it can't be edited, until commit_edits regenerates it.
+         */
+        void prepare_edits();
+
+        /**
+         * Point the children of a node, or the primitives of a leaf, back at it after it moved.
+         */
+        void adopt(uint32_t node);
+
+        /**
+         * Recompute the bounds of a node and each of its ancestors from their children.
+         */
+        void refit_ancestors(uint32_t node);
+
+        /**
+         * Free a pair of sibling nodes, by moving the last pair in the array into their place.
+         */
+        void release_pair(uint32_t pair);
+
+    public:
+
+        BVHTree() : m_unoptimized_cost(0), m_quantized_cost(0), m_depth(0) {}
+
+        /**
+         * Build the tree over a list of primitives. The list is reordered, so leaf ranges refer to
+         * it directly.
+         *
+         * If opts.quantize is set and opts.width is 4 or 8, the tree is quantized, and can't be
+         * refit or edited afterwards.
+         *
+         * @param max_leaf_size Leaves never hold more than this many primitives. Quantized trees
+         * limit it to bvh_quantized_node<N>::MAX_LEAF_SIZE.
+         * @param scheduler Runs subtrees built in parallel. If null, the whole tree is built on the
+         * calling thread.
+         * @param clip Clips primitives for spatial splits. The list may then grow, holding several
+         * references to the same primitive. Without it, SBVH builds fall back to SAH.
+         */
+        void build(std::vector<bvh_primitive>& prims, const bvh_options& opts, size_t max_leaf_size,
+                   TaskScheduler *scheduler = nullptr, const bvh_split_fn& clip = nullptr);
+
+        /**
+         * Get the SAH cost of the tree as built, before any treelet restructuring.
+         */
+        scalar unoptimized_sah_cost() const { return m_unoptimized_cost; }
+
+        /**
+         * Get the depth of the tree, which bounds the depth of the wide or quantized tree made from
+         * it. Kept up to date by builds, refits and committed edits.
+         */
+        size_t depth() const { return m_depth; }
+
+        /**
+         * Build the tree over primitives which are referred to by their index, rather than by their
+         * position in the list. Every leaf holds a single primitive, so the tree can be edited
+         * afterwards.
+         */
+        void build_editable(std::vector<bvh_primitive> prims, const bvh_options& opts);
+
+        /**
+         * Insert a primitive into the tree, as the sibling of the node which adds the least
+         * surface area to the tree. The search is branch and bound, so usually only visits a few
+         * paths from the root. Only valid for trees with a single primitive per leaf.
+         *
+         * @param prim Index of the primitive. Must not already be in the tree.
+         */
+        void insert(uint32_t prim, const aabb& bounds);
+
+        /**
+         * Remove a primitive from the tree. Its sibling takes the place of their parent. Only valid
+         * for trees with a single primitive per leaf.
+         */
+        void remove(uint32_t prim);
+
+        /**
+         * Change the index a leaf refers to its primitive by.
+         *
+         * @param to New index of the primitive. Must not already be in the tree.
+         */
+        void rename(uint32_t from, uint32_t to);
+
+        /**
+         * Regenerate the wide tree after a batch of edits dropped it, if opts.width asks for one.
+         * Until then, the binary tree is traversed.
+         */
+        void commit_edits(const bvh_options& opts);
+
+        /**
+         * Recompute the bounds of every node bottom up, keeping the structure of the tree. Cheaper
+         * than a rebuild, but the quality of the tree degrades as primitives move.
+         *
+         * @param prim_bounds New bounds of each primitive, in the order of the list the tree was
+         * built over.
+         */
+        void refit(const std::vector<aabb>& prim_bounds, const bvh_options& opts);
+
+        /**
+         * Get the flattened binary tree. Empty once the tree is quantized.
+         */
+        const std::vector<bvh_node>& nodes() const { return m_nodes; }
+
+        /**
+         * Check if the tree is empty.
+         */
+        bool empty() const { return m_nodes.empty() && m_qnodes4.empty() && m_qnodes8.empty(); }
+
+        /**
+         * Get the number of bytes allocated for the nodes of the tree.
+         */
+        size_t memory_usage() const;
+
+        /**
+         * Call a function with the primitive range of every leaf, in primitive order.
+         */
+        void visit_leaves(const std::function<void(uint32_t first, uint32_t count)>& fn) const;
+
+        /**
+         * Compute the expected cost of tracing a ray through the tree, as estimated by the surface
+         * area heuristic.
+         */
+        scalar sah_cost(const bvh_options& opts) const;
+
+        /**
+         * Measure the quality of the tree used for traversal. Wide trees are measured as they are,
+         * rather than through the binary tree they were collapsed from.
+         */
+        bvh_stats stats(const bvh_options& opts) const;
+
+        /**
+         * Traverse the tree front to back. Nodes left before the start of the ray, or entered
+         * beyond the closest intersection found so far, are culled. Only instantiated by the BVH
+         * implementation.
+         *
+         * @tparam AnyHit If set, the traversal ends at the first leaf reporting a hit, and children
+         * are visited in no particular order.
+         * @param closest Distance to the closest intersection so far. Expected to start no further
+         * than the end of the ray, and shrink as leaves are hit.
+         * @param visit_leaf Called with the primitive range of each leaf entered by the ray.
+         * Returns true if the leaf was hit.
+         * @param stats Receives the nodes visited and boxes tested. May be null.
+         */
+        template <bool AnyHit = false, typename LeafFn>
+        void traverse(const Ray& r, const scalar& closest, LeafFn visit_leaf,
+                      traversal_stats *stats) const;
+
+        /**
+         * Traverse the tree front to back with a packet of rays. Each node is visited once for every
+         * ray of the packet entering it. Children missed by the whole packet are culled with a
+         * single interval test, before the rays are tested against them one lane each. Only
+         * instantiated by the BVH implementation.
+         *
+         * @param lanes Bitmask of the rays of the packet to trace.
+         * @param closest Distance to the closest intersection so far of each ray. Expected to start
+         * no further than the end of the ray, and shrink as leaves are hit.
+         * @param visit_leaf Called with the primitive range of each leaf entered, and a bitmask of
+         * the rays which may enter it.
+         * @param stats Receives the nodes visited and boxes tested by the packet. May be null.
+         */
+        template <typename LeafFn>
+        void traverse_packet(const ray_packet& packet, uint32_t lanes, const scalar *closest,
+                             LeafFn visit_leaf, traversal_stats *stats) const;
+};
+
+#if defined(__AVX__) && !defined(USE_DOUBLE_PRECISION)
+const static size_t TRIANGLE_PACKET_SIZE = 8;
+#else
+const static size_t TRIANGLE_PACKET_SIZE = 4;
+#endif
+
+/**
+ * Group of triangles from a mesh BVH leaf, stored in structure of arrays form so a ray can be
+ * tested against all of them at once with SIMD. Leaves larger than a packet span several
+ * consecutive packets. Unused slots repeat the first triangle of the packet.
+ */
+struct alignas(32) triangle_packet {
+    scalar p0[3][TRIANGLE_PACKET_SIZE];
+    scalar p1[3][TRIANGLE_PACKET_SIZE];
+    scalar p2[3][TRIANGLE_PACKET_SIZE];
+    uint32_t face[TRIANGLE_PACKET_SIZE];
+};
+
+/**
+ * Bottom level BVH over the triangles of a single mesh. Built once per mesh in the scene, and shared
+ * by every instance of that mesh.
+ */
+class MeshBVH {
+    private:
+
+        const Mesh *m_mesh;
+        std::vector<uint32_t> m_faces; // Face indices, ordered so each leaf covers a contiguous range
+        std::vector<triangle_packet> m_packets; // Triangles of the leaves, in leaf order
+        std::vector<uint32_t> m_leaf_packets; // First packet of the leaf starting at each face index
+        BVHTree m_tree;
+
+    public:
+
+        /**
+         * Constructs a BVH over the triangles of a mesh.
+         *
+         * @param scheduler Runs subtrees built in parallel. If null, the BVH is built on the calling
+         * thread.
+         */
+        MeshBVH(const Mesh& mesh, const bvh_options& opts, TaskScheduler *scheduler = nullptr);
+
+        /**
+         * Get the mesh this BVH was built over.
+         */
+        const Mesh& mesh() const { return *m_mesh; }
+
+        /**
+         * Get the number of triangle references held by the leaves. Larger than the triangle count
+         * of the mesh if triangles were split between leaves.
+         */
+        size_t reference_count() const { return m_faces.size(); }
+
+        /**
+         * Compute the SAH cost of this BVH as built, before any treelet restructuring.
+         */
+        scalar unoptimized_sah_cost() const { return m_tree.unoptimized_sah_cost(); }
+
+        /**
+         * Get the depth of this BVH, counting the root as depth 0.
+         */
+        size_t depth() const { return m_tree.depth(); }
+
+        /**
+         * Get the number of bytes allocated for the nodes, face indices and triangle packets of this
+         * BVH.
+         */
+        size_t memory_usage() const;
+
+        /**
+         * Compute the expected cost of tracing a ray through this BVH, as estimated by the surface
+         * area heuristic.
+         */
+        scalar sah_cost(const bvh_options& opts) const;
+
+        /**
+         * Measure the quality of this BVH.
+         */
+        bvh_stats stats(const bvh_options& opts) const { return m_tree.stats(opts); }
+
+        /**
+         * Trace an object space ray against the triangles of the mesh.
+         *
+         * @param r Ray in the object space of the mesh.
+         * @param info Closest intersection found so far. Updated if a closer triangle is hit within
+         * the [tmin, tmax] of the ray.
+         * @param stats Receives the work done by the trace. May be null.
+         * @return True if a closer intersection was found.
+         */
+        bool trace_ray(const Ray& r, trace_info& info, traversal_stats *stats = nullptr) const;
+
+        /**
+         * Trace a packet of object space rays against the triangles of the mesh, traversing the
+         * BVH once for the whole packet.
+         *
+         * @param lanes Bitmask of the rays of the packet to trace.
+         * @param info Closest intersection found so far of each ray. Updated like trace_ray.
+         * @param stats Receives the work done by the trace. May be null.
+         * @return Bitmask of the rays for which a closer intersection was found.
+         */
+        uint32_t trace_packet(const ray_packet& packet, uint32_t lanes, trace_info *info,
+                              traversal_stats *stats = nullptr) const;
+
+        /**
+         * Test whether an object space ray hits any triangle of the mesh within its [tmin, tmax].
+         *
+         * @param r Ray in the object space of the mesh.
+         * @param stats Receives the work done by the test. May be null.
+         */
+        bool occluded(const Ray& r, traversal_stats *stats = nullptr) const;
+
+        /**
+         * Test which rays of a packet of object space rays hit any triangle of the mesh within
+         * their [tmin, tmax]. Rays stop taking part in the traversal once they hit.
+         *
+         * @param lanes Bitmask of the rays of the packet to test.
+         * @param stats Receives the work done by the test. May be null.
+         * @return Bitmask of the rays which hit a triangle.
+         */
+        uint32_t occluded_packet(const ray_packet& packet, uint32_t lanes,
+                                 traversal_stats *stats = nullptr) const;
+
+};
+
 /**
  * Bounding Volume Hierarchy. Provides an efficient hierarchy for testing ray intersections in
  * complex scenes.
- * 
+ *
+ * The BVH is split into two levels. The top level is built over every MeshInstance in the scene
+ * graph, while each leaf refers to a MeshBVH over the triangles of the instanced mesh.
  */
 class BVH {
     private:
 
-        std::shared_ptr<BVNode> m_root;
+        std::vector<std::unique_ptr<MeshBVH>> m_mesh_bvhs; // Indices correspond to the scene mesh list
+        std::vector<std::unique_ptr<MeshInstance>> m_instances;
+        /**
+         * Edit made to the top level while a re-optimized copy was being built. Replayed onto the
+         * copy before it replaces the current tree.
+         */
+        struct tree_edit {
+            enum { Insert, Remove, Rename } type;
+            uint32_t prim, to;
+            aabb bounds;
+        };
+
+        std::vector<const MeshBVH*> m_instance_bvhs; // Indices correspond to m_instances
+        std::vector<uint32_t> m_instance_xform_ids; // Indices correspond to m_instances. Instances
+                                                    // with the same id share a transform, so rays
+                                                    // are only moved into their space once.
+        uint32_t m_next_xform_id; // Id for the next transform set by an edit
+        std::vector<size_t> m_instance_slots; // Index in m_instances of each instance handle, or
+                                              // NO_INSTANCE once removed. Scene graph instances get
+                                              // the first handles, in graph order.
+        std::vector<size_t> m_slot_handles; // Handle of each instance in m_instances
+        BVHTree m_tree;
+        bvh_options m_opts;
+        TaskScheduler *m_scheduler; // Runs builds and refits in parallel. May be null.
+        scalar m_built_cost; // Top level SAH cost at the last build
+        size_t m_edits; // Incremental edits since the last re-optimization was started
+        std::future<BVHTree> m_optimized; // Top level being re-optimized in the background
+        std::vector<tree_edit> m_pending_edits; // Edits to replay onto m_optimized
+
+        /**
+         * Apply an edit to the top level, and record it for replay if a re-optimization is running.
+         */
+        void edit_tree(const tree_edit& edit);
+
+        /**
+         * Count an incremental edit, and start re-optimizing the top level in the background once
+         * enough of it was edited.
+         */
+        void schedule_optimization();
+
+        /**
+         * Replace the top level with its re-optimized copy, if one was started.
+         *
+         * @param wait Wait for the copy to finish. Otherwise it is only applied if already done.
+         */
+        void apply_optimization(bool wait);
+
+        /**
+         * Build the top level over the instances, and reorder them to match its leaves.
+         *
+         * @param prims Bounds of each instance, indexed by position in m_instances.
+         */
+        void build_top_level(std::vector<bvh_primitive>& prims);
 
     public:
 
         /**
-         * Constructs a BVH given a scene graph.
+         * Constructs a BVH given a scene graph. Instances are always placed in leaves of their own,
+         * opts.max_leaf_size only applies to the mesh BVHs.
+         *
+         * @param scheduler Runs construction, and later refits, in parallel. If null, the BVH is
+         * built on the calling thread.
+         */
+        BVH(const Scene& scene_graph, const bvh_options& opts, TaskScheduler *scheduler = nullptr);
+
+        /**
+         * Compute the expected cost of tracing a ray through the top level of this BVH, as estimated
+         * by the surface area heuristic. Mesh BVHs are not included.
+         */
+        scalar sah_cost(const bvh_options& opts) const;
+
+        /**
+         * Move the instances to their transforms at a point in an animation, and refit the top level
+         * to match. The top level is rebuilt instead if refitting degraded it too much. Mesh BVHs
+         * are kept, since node animations leave meshes unchanged.
+         *
+         * @param scene_graph Scene the BVH was built over.
+         * @param time Time in seconds from the start of the animation.
+         */
+        void update(const Scene& scene_graph, const SceneAnimation& animation, double time);
+
+        /** Handle of an instance which was removed */
+        const static size_t NO_INSTANCE = SIZE_MAX;
+
+        /**
+         * Add an instance of a scene mesh to the BVH, without rebuilding it. Costs O(log n) in the
+         * number of instances. Like the other edits, it takes effect at once, but the top level
+         * only regains its wide layout once commit_edits is called.
+         *
+         * @param mesh Index of the mesh in the scene mesh list.
+         * @param xform Transform of the instance from object to world space.
+         * @return Handle referring to the instance in later edits.
+         * @throws out_of_range Thrown if the mesh doesn't exist.
+         */
+        size_t insert_instance(size_t mesh, const mat4& xform);
+
+        /**
+         * Remove an instance from the BVH, without rebuilding it.
+         *
+         * @param handle Handle of the instance. Instances of the scene graph are numbered in
+         * depth first order, followed by the handles returned from insert_instance.
+         * @throws out_of_range Thrown if no such instance exists.
          */
-        BVH(const Scene& scene_graph);
+        void remove_instance(size_t handle);
 
         /**
-         * Trace a ray into the BVH. If the ray intersects with any objects in the scene, information
-         * about the first intersection will be returned. See trace_info for more info.
+         * Move an instance to a new transform, reinserting it into the BVH.
+         *
+         * @throws out_of_range Thrown if no such instance exists.
          */
-        trace_info trace_ray(const Ray& r) const;
+        void move_instance(size_t handle, const mat4& xform);
+
+        /**
+         * Finish a batch of edits before tracing again. Edited top levels are traversed through
+         * their binary tree, so this regenerates the wide tree opts.width asks for. A background
+         * re-optimization of the top level is applied first, if it is done.
+         */
+        void commit_edits();
+
+        /**
+         * Wait for any background re-optimization of the top level to finish, and apply it. Edits
+         * are committed as with commit_edits.
+         */
+        void finish_optimization();
+
+        /**
+         * Trace a ray into the BVH. If the ray intersects with any objects in the scene within its
+         * [tmin, tmax], information about the first intersection will be returned. See trace_info
+         * for more info.
+         *
+         * @param stats Receives the work done by the trace, across both levels. May be null.
+         */
+        trace_info trace_ray(const Ray& r, traversal_stats *stats = nullptr) const;
+
+        /**
+         * Trace a packet of coherent rays into the BVH, giving the same intersections as tracing
+         * each ray with trace_ray. Both levels are traversed once for the whole packet. Packets
+         * which aren't coherent fall back to tracing one ray at a time.
+         *
+         * @param info Receives the first intersection of each ray in the packet.
+         * @param stats Receives the work done by the trace, across both levels. May be null.
+         */
+        void trace_packet(const ray_packet& packet, trace_info *info,
+                          traversal_stats *stats = nullptr) const;
+
+        /**
+         * Test whether anything in the scene blocks a ray within its [tmin, tmax]. Stops at the
+         * first intersection found, so it's cheaper than trace_ray for visibility tests such as
+         * shadows.
+         *
+         * @param stats Receives the work done by the test, across both levels. May be null.
+         */
+        bool occluded(const Ray& r, traversal_stats *stats = nullptr) const;
+
+        /**
+         * Test which rays of a packet of coherent rays are blocked, giving the same answers as
+         * testing each ray with occluded. Packets which aren't coherent fall back to testing one
+         * ray at a time.
+         *
+         * @param stats Receives the work done by the test, across both levels. May be null.
+         * @return Bitmask of the rays of the packet which are blocked.
+         */
+        uint32_t occluded_packet(const ray_packet& packet, traversal_stats *stats = nullptr) const;
 
 };
 
 /**
- * Node in BVH. Represents a bounding volume in the hierarchy. Leaf nodes have an attached
- * MeshInstance.
+ * Node in the BVH build tree. Represents a bounding volume in the hierarchy. Leaf nodes refer to a
+ * contiguous range of primitives owned by the containing BVH. Only used during construction, the
+ * finished tree is flattened into an array of bvh_node.
  */
 class BVNode {
     private:
 
-        friend class BVH;
-
         aabb m_volume; // TODO Provide different BV options?
-        std::unique_ptr<MeshInstance> m_obj;
+        size_t m_first, m_count;
         std::shared_ptr<BVNode> m_left, m_right;
 
     public:
@@ -83,26 +721,41 @@ class BVNode {
         BVNode(aabb volume, std::shared_ptr<BVNode> left, std::shared_ptr<BVNode> right);
 
         /**
-         * Construct a leaf node with the given mesh instance and bounding volume.
-         * 
-         * @param obj unique_ptr to a MeshInstance, which is moved into the BVNode.
+         * Construct a leaf node with the given bounding volume, covering a range of primitives.
+         *
+         * @param first Index of the first primitive in the leaf.
+         * @param count Number of primitives in the leaf. Must be nonzero.
          */
-        BVNode(aabb volume, std::unique_ptr<MeshInstance>& obj);
+        BVNode(aabb volume, size_t first, size_t count);
 
         /**
          * Check if the BVNode is a leaf node.
          */
-        bool is_leaf() const { return m_obj != nullptr; }
+        bool is_leaf() const { return m_count > 0; }
 
         /**
          * Get the bounding volume associated with this node.
          */
         const aabb& bounding_volume() const { return m_volume; }
 
-        /** 
-         * Get the MeshInstance associated with this node. If the node is not a leaf, it will return
-         * nullptr.
+        /**
+         * Get the index of the first primitive in this leaf.
+         */
+        size_t first_primitive() const { return m_first; }
+
+        /**
+         * Get the number of primitives in this leaf. If the node is not a leaf, it will return 0.
+         */
+        size_t primitive_count() const { return m_count; }
+
+        /**
+         * Get the left child of this node. Leaf nodes have no children.
+         */
+        const BVNode* left() const { return m_left.get(); }
+
+        /**
+         * Get the right child of this node. Leaf nodes have no children.
          */
-        const MeshInstance* object() const { return m_obj.get(); }
+        const BVNode* right() const { return m_right.get(); }
 
 };
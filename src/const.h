@@ -19,6 +19,8 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#pragma once
+
 #include "types.h"
 #include <limits>
 #include <glm/vec3.hpp>
@@ -26,6 +28,19 @@
 
 const static scalar SCALAR_INF = std::numeric_limits<scalar>::infinity();
 
+/**
+ * Factor applied to the far distance of ray/box slab tests, to cover the rounding error of
+ * computing the distances (Ize, 2013). Keeps rays grazing the corner of a box from missing it.
+ */
+const static scalar SLAB_FAR_SCALE = 1 + 2 * (3 * std::numeric_limits<scalar>::epsilon() / 2)
+    / (1 - 3 * std::numeric_limits<scalar>::epsilon() / 2);
+
+/**
+ * Offset of shadow ray origins from the surface, relative to the magnitude of the hit position. Keeps
+ * shadow rays from hitting the surface they start on due to rounding of the hit position.
+ */
+const static scalar SHADOW_RAY_BIAS = 1e-4;
+
 const static vec3 VEC3_MAXIMUM = vec3(SCALAR_INF, SCALAR_INF, SCALAR_INF);
 const static vec3 VEC3_MINIMUM = -VEC3_MAXIMUM;
 
@@ -21,10 +21,12 @@
 
 #include <iostream>
 #include <iomanip>
+#include <sstream>
 #include <glm/vec3.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <boost/program_options.hpp>
 #include <thread>
+#include <memory>
 #include "obj_file.h"
 #include "model.h"
 #include "light.h"
@@ -37,6 +39,22 @@
 #include <glm/gtx/string_cast.hpp>
 
 #include "scene.h"
+#include "scheduler.h"
+
+/**
+ * Get the output path of a frame in a sequence, by numbering the given path before its extension.
+ */
+static std::string sequence_frame_path(const std::string& path, size_t frame)
+{
+    std::ostringstream number;
+    number << '_' << std::setw(4) << std::setfill('0') << frame;
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return path + number.str();
+    }
+    return path.substr(0, dot) + number.str() + path.substr(dot);
+}
 
 int main(int argc, char **argv)
 {
@@ -47,6 +65,11 @@ int main(int argc, char **argv)
     int img_width, img_height;
     scalar fov;
     size_t threads;
+    std::string bvh_split;
+    bvh_options bopts;
+    size_t frames;
+    double fps;
+    std::string anim_name;
 
     int result = 0;
     bool show_help = false;
@@ -66,7 +89,24 @@ int main(int argc, char **argv)
         ("interp-coloring", "Enable interpolated coloring mode")
         ("fov", po::value<scalar>(&fov), "Override camera field of view. Given as vertical FOV in degrees.")
         ("msaa", "Enable Multisample Anti-Aliasing")
-        ("threads,t", po::value<size_t>(&threads)->default_value(0), "Number of rendering threads (0 uses a reasonable default)")
+        ("no-packets", "Trace primary rays one at a time, rather than in packets of neighboring samples")
+        ("wavefront", "Trace and shade each tile in stages, sorting hits by mesh and binning shadow rays")
+        ("threads,t", po::value<size_t>(&threads)->default_value(0), "Number of threads for loading, BVH builds, rendering and encoding (0 uses a reasonable default)")
+        ("frames", po::value<size_t>(&frames)->default_value(0), "Render this many frames of the scene animation, numbering the output files (0 renders a single still)")
+        ("fps", po::value<double>(&fps)->default_value(24.0), "Frame rate of the rendered animation")
+        ("animation", po::value<std::string>(&anim_name), "Name of the animation to render (defaults to the first)")
+        ("rebuild-threshold", po::value<scalar>(&bopts.rebuild_threshold)->default_value(bopts.rebuild_threshold), "Rebuild the top level BVH between frames once refitting raises its SAH cost by this factor")
+        ("bvh-split", po::value<std::string>(&bvh_split)->default_value("sah"), "BVH split method (median, sah, lbvh, sbvh)")
+        ("lbvh-refine", "Rebuild the upper levels of an LBVH with SAH")
+        ("sbvh-budget", po::value<scalar>(&bopts.sbvh_budget)->default_value(bopts.sbvh_budget), "Extra triangle references an SBVH may create, as a fraction of the triangle count")
+        ("treelet-passes", po::value<size_t>(&bopts.treelet_passes)->default_value(bopts.treelet_passes), "Number of treelet restructuring passes run over each BVH after building it")
+        ("bvh-leaf-size", po::value<size_t>(&bopts.max_leaf_size)->default_value(bopts.max_leaf_size), "Maximum number of triangles in a BVH leaf")
+        ("sah-bins", po::value<size_t>(&bopts.sah_bins)->default_value(bopts.sah_bins), "Number of bins per axis used by the SAH BVH builder")
+        ("sah-traversal-cost", po::value<scalar>(&bopts.traversal_cost)->default_value(bopts.traversal_cost), "Relative cost of a BVH node test in the SAH cost model")
+        ("sah-intersection-cost", po::value<scalar>(&bopts.intersection_cost)->default_value(bopts.intersection_cost), "Relative cost of a primitive test in the SAH cost model")
+        ("bvh-width", po::value<size_t>(&bopts.width)->default_value(bopts.width), "Branching factor of the BVH used for traversal (2, 4, 8)")
+        ("bvh-report", "Log quality statistics of the BVH after building it, and traversal statistics after rendering")
+        ("bvh-quantize", "Store mesh BVH child bounds with 8 bits per plane, to save memory (needs a BVH width of 4 or 8)")
         ;
     po::variables_map argmap;
     try {
@@ -95,9 +135,56 @@ int main(int argc, char **argv)
         return result;
     }
 
+    if (bvh_split == "median") {
+        bopts.split_method = BVHSplitMethod::Median;
+    } else if (bvh_split == "sah") {
+        bopts.split_method = BVHSplitMethod::SAH;
+    } else if (bvh_split == "lbvh") {
+        bopts.split_method = BVHSplitMethod::LBVH;
+    } else if (bvh_split == "sbvh") {
+        bopts.split_method = BVHSplitMethod::SBVH;
+    } else {
+        std::cerr << "Unknown BVH split method " << std::quoted(bvh_split) << std::endl;
+        return 1;
+    }
+    bopts.lbvh_refine = argmap.count("lbvh-refine") > 0;
+    if (bopts.width != 2 && bopts.width != 4 && bopts.width != 8) {
+        std::cerr << "BVH width must be 2, 4 or 8" << std::endl;
+        return 1;
+    }
+    bopts.quantize = argmap.count("bvh-quantize") > 0;
+    bopts.report = argmap.count("bvh-report") > 0;
+    if (bopts.quantize && bopts.width == 2) {
+        std::cerr << "Quantized BVH nodes need a BVH width of 4 or 8" << std::endl;
+        return 1;
+    }
+    if (bopts.quantize && bopts.max_leaf_size > bvh_quantized_node<4>::MAX_LEAF_SIZE) {
+        std::cerr << "Quantized BVH leaves can't hold more than "
+            << bvh_quantized_node<4>::MAX_LEAF_SIZE << " triangles" << std::endl;
+        return 1;
+    }
+    if (bopts.sbvh_budget < 0) {
+        std::cerr << "SBVH budget must not be negative" << std::endl;
+        return 1;
+    }
+    if (frames > 0 && !(fps > 0)) {
+        std::cerr << "Frame rate must be positive" << std::endl;
+        return 1;
+    }
+    if (bopts.max_leaf_size == 0) {
+        std::cerr << "BVH leaf size must be at least 1" << std::endl;
+        return 1;
+    }
+
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    TaskScheduler scheduler(threads);
+    std::cout << "Using " << scheduler.concurrency() << " threads" << std::endl;
+
     std::string infile = argmap["input"].as<std::string>();
     std::cout << "Loading scene from file \"" << infile << "\"" << std::endl;
-    Scene scene_graph(infile);
+    Scene scene_graph(infile, &scheduler);
     {
         auto *s = scene_graph.assimp_scene();
         if (s != nullptr && s->mNumMeshes > 0) {
@@ -149,7 +236,7 @@ int main(int argc, char **argv)
     render_options ropts;
     ropts.width = img_width;
     ropts.height = img_height;
-    Renderer renderer(scene_graph, std::move(lights));
+    Renderer renderer(scene_graph, std::move(lights), bopts, &scheduler);
     ropts.debug_flags = debug_mode::none;
     if (argmap.count("normal-coloring")) {
         std::cout << "DEBUG: Normal coloring mode enabled" << std::endl;
@@ -162,14 +249,47 @@ int main(int argc, char **argv)
     if (argmap.count("msaa")) {
         ropts.msaa = true;
     }
-    if (threads == 0) {
-        threads = std::thread::hardware_concurrency();
+    ropts.packets = argmap.count("no-packets") == 0;
+    ropts.wavefront = argmap.count("wavefront") != 0;
+    ropts.bvh_report = bopts.report;
+    if (frames == 0) {
+        Framebuffer image = renderer.render(cam, ropts);
+        pnghelper_write_image_file(outfile.c_str(), image.row(0), img_width, img_height,
+                                   image.stride() * sizeof(rgb_color));
+        return result;
     }
-    ropts.concurrency = threads;
-    std::cout << "Using " << threads << " rendering threads" << std::endl;
-    std::vector<rgb_color> imgdata = renderer.render(cam, ropts);
 
-    pnghelper_write_image_file(outfile.c_str(), &imgdata[0], img_width, img_height);
+    auto *s = scene_graph.assimp_scene();
+    const aiAnimation *assimp_anim = nullptr;
+    for (size_t i = 0; i < s->mNumAnimations; ++i) {
+        if (!argmap.count("animation") || anim_name == s->mAnimations[i]->mName.C_Str()) {
+            assimp_anim = s->mAnimations[i];
+            break;
+        }
+    }
+    if (assimp_anim == nullptr) {
+        std::cerr << "No matching animation in scene" << std::endl;
+        return 1;
+    }
+    SceneAnimation animation(*assimp_anim);
+    std::cout << "Rendering " << frames << " frames of animation " << std::quoted(animation.name())
+        << " (" << animation.duration() << "s)" << std::endl;
+    // Each frame is written out while the next one renders. Waiting before handing over a new
+    // frame keeps at most one finished image in memory.
+    TaskGroup encoding(&scheduler);
+    for (size_t frame = 0; frame < frames; ++frame) {
+        double time = frame / fps;
+        std::cout << "Frame " << frame << " at " << time << "s" << std::endl;
+        renderer.update(animation, time);
+        auto image = std::make_shared<Framebuffer>(renderer.render(cam, ropts));
+        std::string framefile = sequence_frame_path(outfile, frame);
+        encoding.wait();
+        encoding.run([image, framefile, img_width, img_height]() {
+            pnghelper_write_image_file(framefile.c_str(), image->row(0), img_width, img_height,
+                                       image->stride() * sizeof(rgb_color));
+        });
+    }
+    encoding.wait();
 
     return result;
 }
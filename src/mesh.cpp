@@ -32,6 +32,7 @@ Mesh::Mesh(const aiMesh& mesh) :
     m_faces.reserve(mesh.mNumFaces);
     m_vertices.reserve(mesh.mNumVertices);
     m_plane_normals.reserve(mesh.mNumFaces);
+    m_records.reserve(mesh.mNumFaces);
     if (mesh.mNormals != nullptr) {
         m_normals.reserve(mesh.mNumVertices);
     }
@@ -62,6 +63,7 @@ Mesh::Mesh(const aiMesh& mesh) :
         auto& p2 = m_vertices[f.index[2]];
         vec4 pnorm = vec4(glm::normalize(glm::cross(vec3(p1-p0), vec3(p2-p0))), 0.0);
         m_plane_normals.emplace_back(pnorm);
+        m_records.push_back({vec3(p0), vec3(p1), vec3(p2)});
     }
     m_aabb = aabb(*this);
 }
@@ -70,3 +72,9 @@ MeshInstance::MeshInstance(const Mesh& mesh, mat4 xform) :
     m_mesh(mesh),
     m_xform(xform),
     m_inv_xform(glm::inverse(xform)) {}
+
+void MeshInstance::set_transform(const mat4& xform)
+{
+    m_xform = xform;
+    m_inv_xform = glm::inverse(xform);
+}
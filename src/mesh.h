@@ -36,6 +36,7 @@ class Mesh {
     public:
 
         struct face;
+        struct triangle_record;
 
     private:
 
@@ -43,6 +44,7 @@ class Mesh {
         std::vector<face> m_faces;
         std::vector<vec4> m_vertices;
         std::vector<vec4> m_plane_normals;
+        std::vector<triangle_record> m_records;
         std::vector<vec4> m_normals;
         std::vector<vec2> m_uvs;
         aabb m_aabb;
@@ -53,6 +55,14 @@ class Mesh {
             size_t index[3];
         };
 
+        /**
+         * Vertices of a face, gathered in one place so ray intersection tests load a single record
+         * instead of following the vertex indices.
+         */
+        struct triangle_record {
+            vec3 p0, p1, p2;
+        };
+
         class TriangleIter;
 
         class TriangleContainer {
@@ -108,6 +118,11 @@ class Mesh {
                  */
                 inline const vec4& plane_normal() const;
 
+                /**
+                 * Get the precomputed vertex record of the triangle.
+                 */
+                inline const triangle_record& record() const;
+
                 /**
                  * Compute the normal at a point on the surface of the triangle.
                  *
@@ -179,6 +194,11 @@ class Mesh {
          */
         const std::vector<vec4>& plane_normals() const { return m_plane_normals; }
 
+        /**
+         * Get the list of triangle records. Indices correspond to the faces.
+         */
+        const std::vector<triangle_record>& triangle_records() const { return m_records; }
+
         /**
          * Get the list of normals. Indices correspond to the vertices.
          */
@@ -223,6 +243,11 @@ class MeshInstance {
          */
         const mat4& transform() const { return m_xform; }
 
+        /**
+         * Move the instance to a new transform from object to world space.
+         */
+        void set_transform(const mat4& xform);
+
         /**
          * Get the transform from world to object space.
          */
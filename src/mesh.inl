@@ -97,6 +97,11 @@ inline const vec4& Mesh::Triangle::plane_normal() const
     return m_mesh->plane_normals()[m_face];
 }
 
+inline const Mesh::triangle_record& Mesh::Triangle::record() const
+{
+    return m_mesh->triangle_records()[m_face];
+}
+
 inline vec4 Mesh::Triangle::surface_normal(vec3 coords) const
 {
     if (m_mesh->normals().empty()) {
@@ -24,7 +24,8 @@
 #include <stdio.h>
 #include <stdint.h>
 
-int pnghelper_write_image_file(const char *file, const void *bytes, size_t width, size_t height)
+int pnghelper_write_image_file(const char *file, const void *bytes, size_t width, size_t height,
+                               size_t stride)
 {
     int result = 0;
 
@@ -55,7 +56,7 @@ int pnghelper_write_image_file(const char *file, const void *bytes, size_t width
         goto cleanup;
     }
     for (size_t i = 0; i < height; ++i) {
-        rows[i] = ((uint8_t*)bytes) + width * 3 * i;
+        rows[i] = ((uint8_t*)bytes) + stride * i;
     }
 
     if (setjmp(png_jmpbuf(png))) {
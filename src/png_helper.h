@@ -32,7 +32,8 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
-    int pnghelper_write_image_file(const char *file, const void *bytes, size_t width, size_t height);
+    int pnghelper_write_image_file(const char *file, const void *bytes, size_t width, size_t height,
+                                   size_t stride);
 #ifdef __cplusplus
 }
 #endif
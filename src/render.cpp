@@ -23,14 +23,24 @@
 #include "convert.h"
 #include "const.h"
 #include "assimp_tools.h"
+#include "wavefront.h"
+#include "scheduler.h"
 #include <glm/common.hpp>
 #include <glm/trigonometric.hpp>
 #include <glm/geometric.hpp>
 #include <glm/gtc/constants.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <iostream>
-#include <thread>
+#include <algorithm>
+#include <cmath>
 #include <functional>
+#include <chrono>
+#include <atomic>
+#include <string>
+#include <new>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/gtx/string_cast.hpp>
@@ -41,7 +51,9 @@ render_options::render_options() :
     debug_flags(debug_mode::none),
     msaa(false),
     max_recursion(1),
-    concurrency(1)
+    bvh_report(false),
+    packets(true),
+    wavefront(false)
 {
 }
 
@@ -57,24 +69,31 @@ vec3 linear_to_srgb(vec3 color) {
 Camera::Camera() :
     m_xform(1.0),
     m_fov(glm::radians(90.0)),
-    m_aspect(16.0 / 9.0) {}
+    m_aspect(16.0 / 9.0),
+    m_near(0),
+    m_far(SCALAR_INF) {}
 
-Camera::Camera(mat4 xform, scalar fov, scalar aspect) :
+Camera::Camera(mat4 xform, scalar fov, scalar aspect, scalar near_plane, scalar far_plane) :
     m_xform(glm::inverse(xform)),
     m_fov(fov),
     m_aspect(aspect),
-    m_is_fov_horizontal(false)
+    m_is_fov_horizontal(false),
+    m_near(near_plane),
+    m_far(far_plane)
 {
 }
 
 Camera::Camera(const aiScene& scene, const aiCamera& camera) :
     m_fov(camera.mHorizontalFOV / camera.mAspect),
     m_aspect(camera.mAspect),
-    m_is_fov_horizontal(true)
+    m_is_fov_horizontal(true),
+    m_near(camera.mClipPlaneNear),
+    m_far(camera.mClipPlaneFar)
 {
     mat4 node_xform = MAT4_IDENTITY;
     std::cout << "Camera fov: " << m_fov << std::endl;
     std::cout << "Camera aspect: " << m_aspect << std::endl;
+    std::cout << "Camera clip planes: " << m_near << ", " << m_far << std::endl;
     if (search_assimp_scene_graph(scene, camera.mName, node_xform) != nullptr) {
         auto pos = vec3(node_xform * assimp_vec_to_glm4(camera.mPosition, 1.0));
         auto look_at = vec3(node_xform * assimp_vec_to_glm4(camera.mLookAt, 0.0));
@@ -100,6 +119,12 @@ void Camera::set_aspect(scalar aspect, bool keep_vertical_fov)
     m_aspect = aspect;
 }
 
+void Camera::set_clip_planes(scalar near_plane, scalar far_plane)
+{
+    m_near = near_plane;
+    m_far = far_plane;
+}
+
 Ray Camera::compute_ray(vec2 pos) const
 {
     Ray out;
@@ -107,114 +132,489 @@ Ray Camera::compute_ray(vec2 pos) const
     scalar tan = glm::tan(m_fov * 0.5);
     x = tan * m_aspect * pos.x;
     y = tan * pos.y;
-    out.dir = glm::normalize(m_xform * vec4(x, y, -1.0, 0.0));
-    out.origin = m_xform * vec4(0.0, 0.0, 0.0, 1.0); // TODO Cache origin?
+    vec4 view_dir(x, y, -1.0, 0.0);
+    out.dir = glm::normalize(m_xform * view_dir);
+    out.origin = m_xform * vec4(0.0, 0.0, 0.0, 1.0);
+    // Clip planes lie across the view direction, so they're further away along off center rays
+    scalar len = glm::length(view_dir);
+    out.tmin = m_near * len;
+    out.tmax = m_far * len;
     return out;
 }
 
-Renderer::Renderer(const Scene& scene_graph, std::vector<std::unique_ptr<Light>> lights) :
+void Framebuffer::aligned_delete::operator()(rgb_color *p) const
+{
+    ::operator delete(p, std::align_val_t(CACHE_LINE_SIZE));
+}
+
+Framebuffer::Framebuffer(size_t width, size_t height) :
+    m_width(width),
+    m_height(height),
+    m_stride((width + FRAMEBUFFER_ROW_ALIGN - 1) / FRAMEBUFFER_ROW_ALIGN * FRAMEBUFFER_ROW_ALIGN),
+    m_pixels(static_cast<rgb_color*>(::operator new(m_stride * height * sizeof(rgb_color),
+                                                    std::align_val_t(CACHE_LINE_SIZE))))
+{
+}
+
+#if defined(__SSE2__) && !defined(USE_DOUBLE_PRECISION)
+/**
+ * Operations on a SIMD register holding one float per ray, for generating rays several at a time.
+ */
+struct ray_lanes {
+#if defined(__AVX__)
+    typedef __m256 type;
+    const static size_t width = 8;
+    static type set1(float v) { return _mm256_set1_ps(v); }
+    static type load(const float *p) { return _mm256_loadu_ps(p); }
+    static void store(float *p, type a) { _mm256_storeu_ps(p, a); }
+    static type add(type a, type b) { return _mm256_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+    static type div(type a, type b) { return _mm256_div_ps(a, b); }
+    static type sqrt(type a) { return _mm256_sqrt_ps(a); }
+#else
+    typedef __m128 type;
+    const static size_t width = 4;
+    static type set1(float v) { return _mm_set1_ps(v); }
+    static type load(const float *p) { return _mm_loadu_ps(p); }
+    static void store(float *p, type a) { _mm_storeu_ps(p, a); }
+    static type add(type a, type b) { return _mm_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm_mul_ps(a, b); }
+    static type div(type a, type b) { return _mm_div_ps(a, b); }
+    static type sqrt(type a) { return _mm_sqrt_ps(a); }
+#endif
+};
+#endif
+
+RayGenerator::RayGenerator(const Camera& cam, size_t sample_width, size_t sample_height) :
+    m_near(cam.near_plane()),
+    m_far(cam.far_plane()),
+    m_screen_x(sample_width),
+    m_screen_y(sample_height)
+{
+    mat4 xform = cam.get_transform();
+    m_origin = xform * vec4(0.0, 0.0, 0.0, 1.0);
+    m_right = xform[0];
+    m_up = xform[1];
+    m_back = xform[2];
+    // Same steps as compute_ray, so each ray rounds the same way
+    scalar tan = glm::tan(cam.fov() * 0.5);
+    for (size_t x = 0; x < sample_width; ++x) {
+        scalar pos = 2.0 * (scalar)x / (scalar)sample_width - 1.0;
+        m_screen_x[x] = tan * cam.aspect() * pos;
+    }
+    for (size_t y = 0; y < sample_height; ++y) {
+        scalar pos = 1.0 - 2.0 * (scalar)y / (scalar)sample_height;
+        m_screen_y[y] = tan * pos;
+    }
+}
+
+void RayGenerator::generate(size_t x, size_t y, size_t width, size_t height,
+                            primary_rays& out) const
+{
+    size_t count = width * height;
+    out.origin = m_origin;
+    out.dir_x.resize(count);
+    out.dir_y.resize(count);
+    out.dir_z.resize(count);
+    out.tmin.resize(count);
+    out.tmax.resize(count);
+    for (size_t row = 0; row < height; ++row) {
+        const scalar *xs = &m_screen_x[x];
+        scalar ys = m_screen_y[y + row];
+        size_t first = row * width;
+        size_t i = 0;
+#if defined(__SSE2__) && !defined(USE_DOUBLE_PRECISION)
+        typedef ray_lanes L;
+        // Each lane takes the same steps as the loop below
+        L::type vy = L::set1(ys);
+        L::type ux = L::mul(L::set1(m_up.x), vy);
+        L::type uy = L::mul(L::set1(m_up.y), vy);
+        L::type uz = L::mul(L::set1(m_up.z), vy);
+        L::type one = L::set1(1.0);
+        L::type yy = L::mul(vy, vy);
+        for (; i + L::width <= width; i += L::width) {
+            L::type vx = L::load(xs + i);
+            L::type dx = L::sub(L::add(L::mul(L::set1(m_right.x), vx), ux), L::set1(m_back.x));
+            L::type dy = L::sub(L::add(L::mul(L::set1(m_right.y), vx), uy), L::set1(m_back.y));
+            L::type dz = L::sub(L::add(L::mul(L::set1(m_right.z), vx), uz), L::set1(m_back.z));
+            L::type inv_len = L::div(one, L::sqrt(L::add(L::add(L::mul(dx, dx), L::mul(dy, dy)),
+                                                          L::mul(dz, dz))));
+            L::type view_len = L::sqrt(L::add(L::add(L::mul(vx, vx), yy), one));
+            L::store(&out.dir_x[first + i], L::mul(dx, inv_len));
+            L::store(&out.dir_y[first + i], L::mul(dy, inv_len));
+            L::store(&out.dir_z[first + i], L::mul(dz, inv_len));
+            L::store(&out.tmin[first + i], L::mul(L::set1(m_near), view_len));
+            L::store(&out.tmax[first + i], L::mul(L::set1(m_far), view_len));
+        }
+#endif
+        for (; i < width; ++i) {
+            scalar vx = xs[i];
+            scalar dx = (m_right.x * vx + m_up.x * ys) - m_back.x;
+            scalar dy = (m_right.y * vx + m_up.y * ys) - m_back.y;
+            scalar dz = (m_right.z * vx + m_up.z * ys) - m_back.z;
+            scalar inv_len = (scalar)1.0 / std::sqrt((dx * dx + dy * dy) + dz * dz);
+            // Clip planes lie across the view direction, so they're further away along off
+            // center rays
+            scalar view_len = std::sqrt((vx * vx + ys * ys) + (scalar)1.0);
+            out.dir_x[first + i] = dx * inv_len;
+            out.dir_y[first + i] = dy * inv_len;
+            out.dir_z[first + i] = dz * inv_len;
+            out.tmin[first + i] = m_near * view_len;
+            out.tmax[first + i] = m_far * view_len;
+        }
+    }
+}
+
+Renderer::Renderer(const Scene& scene_graph, std::vector<std::unique_ptr<Light>> lights,
+        const bvh_options& bvh_opts, TaskScheduler *scheduler) :
     m_scene(scene_graph),
-    m_bvh(scene_graph),
-    m_lights(std::move(lights))
+    m_bvh(scene_graph, bvh_opts, scheduler),
+    m_lights(std::move(lights)),
+    m_scheduler(scheduler)
+{
+}
+
+void Renderer::update(const SceneAnimation& animation, double time)
 {
+    m_bvh.update(m_scene, animation, time);
+}
+
+/** Width and height in samples of each block of the screen traced as one ray packet */
+const static size_t PACKET_BLOCK_SIZE = 4;
+
+static_assert(PACKET_BLOCK_SIZE * PACKET_BLOCK_SIZE <= RAY_PACKET_SIZE,
+              "A block of samples should fit in a ray packet");
+
+static_assert(RENDER_TILE_WIDTH % PACKET_BLOCK_SIZE == 0 &&
+              RENDER_TILE_HEIGHT % PACKET_BLOCK_SIZE == 0,
+              "Tiles should split evenly into blocks of samples");
+
+/**
+ * Order the tiles of an image along a square spiral, starting from the center tile. Neighboring
+ * tiles stay close in the order, and the middle of the frame, where the subject usually sits, is
+ * rendered first.
+ *
+ * @param cols Number of columns of tiles.
+ * @param rows Number of rows of tiles.
+ * @return Column and row of each tile, in order.
+ */
+static std::vector<std::pair<size_t, size_t>> spiral_tile_order(size_t cols, size_t rows)
+{
+    std::vector<std::pair<size_t, size_t>> order;
+    order.reserve(cols * rows);
+    // Walk legs of 1, 1, 2, 2, 3, 3... tiles, turning after each, and skip tiles off the image
+    long x = (long)(cols - 1) / 2, y = (long)(rows - 1) / 2;
+    long dx = 1, dy = 0;
+    if (cols > 0 && rows > 0) {
+        order.emplace_back(x, y);
+    }
+    for (size_t run = 1; order.size() < cols * rows; ++run) {
+        for (int leg = 0; leg < 2; ++leg) {
+            for (size_t step = 0; step < run; ++step) {
+                x += dx;
+                y += dy;
+                if (x >= 0 && y >= 0 && x < (long)cols && y < (long)rows) {
+                    order.emplace_back(x, y);
+                }
+            }
+            long turn = dx;
+            dx = -dy;
+            dy = turn;
+        }
+    }
+    return order;
 }
 
 /**
- * Render a range of pixels in the final image.
+ * Shares the tiles of an image out between render tasks. Each task starts with its own run of
+ * consecutive tiles, taken from the front. A task which runs out steals the back half of the
+ * largest run left, so threads stay busy however unevenly the work is spread over the image.
  */
-void Renderer::render_range(   std::vector<rgb_color>& data,
-                            const Camera& cam,
+class TileQueue {
+    private:
+
+        /** Run of tiles left to a thread, packed as begin | end << 32 so it changes atomically */
+        struct alignas(64) tile_run {
+            std::atomic<uint64_t> span;
+        };
+
+        std::vector<tile_run> m_runs;
+
+        static uint64_t pack(uint64_t begin, uint64_t end) { return begin | end << 32; }
+        static size_t run_begin(uint64_t span) { return span & 0xffffffff; }
+        static size_t run_end(uint64_t span) { return span >> 32; }
+
+    public:
+
+        /**
+         * Split tiles between threads in even runs.
+         *
+         * @param count Number of tiles.
+         * @param threads Number of threads taking tiles.
+         */
+        TileQueue(size_t count, size_t threads) :
+            m_runs(threads)
+        {
+            for (size_t t = 0; t < threads; ++t) {
+                m_runs[t].span.store(pack(count * t / threads, count * (t + 1) / threads));
+            }
+        }
+
+        /**
+         * Take the next tile for a thread, stealing from other threads once its own run is done.
+         *
+         * @param thread Index of the thread taking a tile.
+         * @param tile Receives the index of the tile.
+         * @return False once every tile has been taken.
+         */
+        bool pop(size_t thread, size_t& tile)
+        {
+            auto& own = m_runs[thread].span;
+            uint64_t span = own.load();
+            while (run_begin(span) < run_end(span)) {
+                if (own.compare_exchange_weak(span, pack(run_begin(span) + 1, run_end(span)))) {
+                    tile = run_begin(span);
+                    return true;
+                }
+            }
+            for (;;) {
+                size_t victim = m_runs.size(), most = 0;
+                for (size_t t = 0; t < m_runs.size(); ++t) {
+                    span = m_runs[t].span.load();
+                    if (t != thread && run_end(span) - run_begin(span) > most) {
+                        victim = t;
+                        most = run_end(span) - run_begin(span);
+                    }
+                }
+                if (victim == m_runs.size()) {
+                    return false;
+                }
+                auto& other = m_runs[victim].span;
+                span = other.load();
+                while (run_begin(span) < run_end(span)) {
+                    // Steal [mid, end), keeping the first of the stolen tiles for now
+                    size_t mid = run_end(span) - (run_end(span) - run_begin(span) + 1) / 2;
+                    if (other.compare_exchange_weak(span, pack(run_begin(span), mid))) {
+                        own.store(pack(mid + 1, run_end(span)));
+                        tile = mid;
+                        return true;
+                    }
+                }
+            }
+        }
+};
+
+/**
+ * Render a tile of the final image. Samples are traced in square blocks, one ray packet each, and
+ * a row of blocks is finished and written to the image before moving on to the next. In wavefront
+ * mode, every block of the tile is queued first, and the whole tile is traced and shaded as one
+ * batch before it is written.
+ */
+void Renderer::render_tile(    Framebuffer& image,
+                            const RayGenerator& rays,
                             const render_options& opts,
                             uint16_t initx, uint16_t inity,
-                            uint16_t width, uint16_t height) const
-{
-    size_t progress = 0, percent = 0;
-    for (int y = inity; y < inity + height; ++y) {
-        for (int x = initx; x < initx + width; ++x) {
-            size_t samplecount, msfactor = 1;
-            if (opts.msaa) {
-                msfactor = 2;
+                            uint16_t width, uint16_t height,
+                            primary_rays& block_rays,
+                            wavefront_queues& wave,
+                            traversal_stats *stats) const
+{
+    size_t samplecount, msfactor = 1;
+    if (opts.msaa) {
+        msfactor = 2;
+    }
+    samplecount = msfactor * msfactor;
+    size_t sample_width = width * msfactor;
+    size_t sample_height = height * msfactor;
+    vec3 colors[RENDER_TILE_WIDTH * RENDER_TILE_HEIGHT]; // Samples summed per pixel of the tile
+    ray_packet packet;
+    trace_info traces[RAY_PACKET_SIZE];
+    size_t pixels[RAY_PACKET_SIZE]; // Index in colors of the pixel each ray samples
+    std::fill(colors, colors + width * height, vec3(0.0, 0.0, 0.0));
+    // Write rows of the tile out to the image
+    auto write_rows = [&](size_t first, size_t rows) {
+        for (size_t r = first; r < first + rows; ++r) {
+            rgb_color *out = image.row(inity + r) + initx;
+            for (size_t p = 0; p < width; ++p) {
+                vec3 color = colors[r * width + p] * (scalar)(1.0/((scalar)samplecount));
+                // Disable sRGB conversion when using debug color modes
+                if (!(opts.debug_flags & debug_mode::normal_coloring)
+                        && !(opts.debug_flags & debug_mode::interp_coloring)) {
+                    color = linear_to_srgb(color);
+                }
+                out[p].r = color.r * 255;
+                out[p].g = color.g * 255;
+                out[p].b = color.b * 255;
             }
-            std::vector<vec3> samples;
-            samplecount = msfactor * msfactor;
-            for (size_t s = 0; s < samplecount; ++s) {
-                scalar sx, sy;
-                sx = (scalar)(s % msfactor);
-                sy = (scalar)(s / msfactor);
-                Ray view_ray = cam.compute_ray(
-                        vec2(  2.0 * (((scalar)x*msfactor) + sx) / ((scalar)opts.width * msfactor) - 1.0,
-                                    1.0 - 2.0 * (((scalar)y*msfactor) + sy) / ((scalar)opts.height * msfactor)));
-                vec3 sample = this->compute_ray_color(view_ray, opts, opts.max_recursion);
-                samples.push_back(glm::clamp(sample, (scalar)0.0, (scalar)1.0));
+        }
+    };
+    for (size_t by = 0; by < sample_height; by += PACKET_BLOCK_SIZE) {
+        size_t sample_rows = std::min(PACKET_BLOCK_SIZE, sample_height - by);
+        rays.generate(initx * msfactor, inity * msfactor + by, sample_width, sample_rows,
+                      block_rays);
+        for (size_t bx = 0; bx < sample_width; bx += PACKET_BLOCK_SIZE) {
+            packet.count = 0;
+            for (size_t sy = 0; sy < sample_rows; ++sy) {
+                for (size_t sx = bx; sx < std::min(bx + PACKET_BLOCK_SIZE, sample_width); ++sx) {
+                    pixels[packet.count] = ((by + sy) / msfactor) * width + sx / msfactor;
+                    packet.rays[packet.count++] = block_rays.ray(sy * sample_width + sx);
+                }
+            }
+            if (opts.wavefront) {
+                for (size_t i = 0; i < packet.count; ++i) {
+                    wave.primary.push(packet.rays[i], pixels[i]);
+                }
+                continue;
             }
-            vec3 color(0.0, 0.0, 0.0);
-            for (auto& s : samples) {
-                color += s;
+            if (opts.packets) {
+                m_bvh.trace_packet(packet, traces, stats);
+            } else {
+                for (size_t i = 0; i < packet.count; ++i) {
+                    traces[i] = m_bvh.trace_ray(packet.rays[i], stats);
+                }
             }
-            color *= 1.0/((scalar)samples.size());
-            // Disable sRGB conversion when using debug color modes
-            if (!(opts.debug_flags & debug_mode::normal_coloring)
-                    && !(opts.debug_flags & debug_mode::interp_coloring)) {
-                color = linear_to_srgb(color);
+            for (size_t i = 0; i < packet.count; ++i) {
+                vec3 sample = this->compute_hit_color(packet.rays[i], traces[i], opts,
+                        opts.max_recursion, stats);
+                colors[pixels[i]] += glm::clamp(sample, (scalar)0.0, (scalar)1.0);
             }
-            rgb_color imgcolor;
-            imgcolor.r = color.r * 255;
-            imgcolor.g = color.g * 255;
-            imgcolor.b = color.b * 255;
-            data.push_back(imgcolor);
-            progress++;
         }
-        if ((progress * 100 / opts.concurrency) / (width * height) > percent) {
-            percent++;
-            std::cout << "." << std::flush;
+        if (!opts.wavefront) {
+            write_rows(by / msfactor, (by + sample_rows) / msfactor - by / msfactor);
         }
     }
+    if (opts.wavefront) {
+        render_wavefront(wave, opts, stats);
+        for (size_t i = 0; i < wave.primary.size(); ++i) {
+            colors[wave.primary.source[i]] += wave.colors[i];
+        }
+        wave.clear();
+        write_rows(0, height);
+    }
 }
 
-std::vector<rgb_color> Renderer::render(Camera& cam, render_options opts) const
+Framebuffer Renderer::render(Camera& cam, render_options opts) const
 {
-    std::vector<rgb_color> img;
-    img.reserve(opts.width * opts.height);
+    Framebuffer img(opts.width, opts.height);
     std::cout << "Rendering..." << std::flush;
-    std::vector<std::vector<rgb_color>> thread_data;
-    std::vector<std::thread> thread_handles;
-    uint16_t y, height;
-    y = 0;
-    height = opts.height / opts.concurrency;
-    thread_data.resize(opts.concurrency);
-    for (size_t t = 0; t < opts.concurrency; t++) {
-        if (t == opts.concurrency - 1) {
-            height = opts.height - y;
-        }
-        thread_data[t].reserve(opts.width * height);
-        thread_handles.emplace_back(&Renderer::render_range, this,
-                std::ref(thread_data[t]),
-                std::cref(cam),
-                std::cref(opts),
-                0, y, opts.width, height);
-        y += height;
-    }
-    for (auto& h : thread_handles) {
-        h.join();
-    }
-    for (auto& data : thread_data) {
-        img.insert(img.end(), data.cbegin(), data.cend());
+    auto start_time = std::chrono::steady_clock::now();
+    size_t msfactor = opts.msaa ? 2 : 1;
+    RayGenerator rays(cam, (size_t)opts.width * msfactor, (size_t)opts.height * msfactor);
+    auto order = spiral_tile_order((opts.width + RENDER_TILE_WIDTH - 1) / RENDER_TILE_WIDTH,
+                                   (opts.height + RENDER_TILE_HEIGHT - 1) / RENDER_TILE_HEIGHT);
+    size_t workers = m_scheduler != nullptr ? m_scheduler->concurrency() : 1;
+    TileQueue tiles(order.size(), workers);
+    std::atomic<size_t> pixels_done(0), percent(0);
+    std::vector<traversal_stats> thread_stats(workers);
+    auto worker = [&](size_t t) {
+        primary_rays block_rays;
+        wavefront_queues wave;
+        size_t tile;
+        while (tiles.pop(t, tile)) {
+            size_t x = order[tile].first * RENDER_TILE_WIDTH;
+            size_t y = order[tile].second * RENDER_TILE_HEIGHT;
+            size_t width = std::min(RENDER_TILE_WIDTH, opts.width - x);
+            size_t height = std::min(RENDER_TILE_HEIGHT, opts.height - y);
+            render_tile(img, rays, opts, x, y, width, height, block_rays, wave,
+                        opts.bvh_report ? &thread_stats[t] : nullptr);
+            // Print a dot for each percent of the image finished
+            size_t done = (pixels_done += width * height) * 100 / (img.width() * img.height());
+            size_t printed = percent.load();
+            while (printed < done) {
+                if (percent.compare_exchange_weak(printed, done)) {
+                    std::cout << std::string(done - printed, '.') << std::flush;
+                    break;
+                }
+            }
+        }
+    };
+    TaskGroup render_tasks(m_scheduler);
+    for (size_t t = 1; t < workers; t++) {
+        render_tasks.run([&worker, t]() { worker(t); });
     }
+    worker(0);
+    render_tasks.wait();
     std::cout << "done!" << std::endl;
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start_time;
+    size_t primary_rays = (size_t)opts.width * opts.height * (opts.msaa ? 4 : 1);
+    std::cout << "Rendered " << primary_rays << " primary rays in " << elapsed.count() << "s ("
+        << primary_rays / elapsed.count() << " rays/sec)" << std::endl;
+    if (opts.bvh_report) {
+        traversal_stats total;
+        for (auto& stats : thread_stats) {
+            total += stats;
+        }
+        if (total.rays > 0) {
+            std::cout << "BVH report: Traced " << total.rays << " rays, per ray "
+                << (double)total.nodes_visited / total.rays << " nodes visited, "
+                << (double)total.boxes_tested / total.rays << " boxes tested, "
+                << (double)total.triangles_tested / total.rays << " triangles tested"
+                << std::endl;
+        }
+    }
     return img;
 }
 
-vec3 Renderer::compute_ray_color(const Ray& r, const render_options& opts, size_t steps) const
+vec3 Renderer::compute_ray_color(const Ray& r, const render_options& opts, size_t steps,
+                                 traversal_stats *stats) const
+{
+    if (steps == 0) {
+        return vec3(0.0, 0.0, 0.0);
+    }
+    return compute_hit_color(r, m_bvh.trace_ray(r, stats), opts, steps, stats);
+}
+
+/**
+ * Sample the direct light a surface hit receives from a light, ignoring occlusion.
+ *
+ * @param baselight The light to sample.
+ * @param trace The surface hit being lit.
+ * @param radiance Receives the light reflected back along the view ray.
+ * @param shadow Receives the ray which must be unoccluded for the light to reach the hit.
+ * @return True if the shadow ray must be traced, false if the light is unaffected by occluders.
+ */
+static bool sample_light(const Light& baselight, const trace_info& trace, vec3& radiance, Ray& shadow)
+{
+    vec4 l, n = trace.hitnorm; // Light dir, normal
+    vec3 El; // Irradiance
+    scalar light_distance = SCALAR_INF; // Directional lights are infinitely far
+    switch (baselight.type()) {
+        case LightType::Directional: {
+            auto& light = dynamic_cast<const DirectionalLight&>(baselight);
+            El = light.color() * light.intensity();
+            l = -light.direction();
+        } break;
+        case LightType::Point: {
+            auto& light = dynamic_cast<const PointLight&>(baselight);
+            l = light.position() - trace.hitpos;
+            scalar r2 = glm::dot(l, l);
+            light_distance = glm::sqrt(r2);
+            l = glm::normalize(l);
+            El = light.color() * light.intensity() / r2;
+        } break;
+    }
+    radiance = glm::one_over_pi<scalar>() * vec3(1.0, 1.0, 1.0) * El * glm::dot(l, n);
+    if (glm::dot(l, n) <= 0) {
+        return false;
+    }
+    // Shadow rays start off the surface, so they don't hit the triangle they leave from
+    vec3 p(trace.hitpos);
+    scalar bias = SHADOW_RAY_BIAS * std::max((scalar)1,
+            std::max(std::abs(p.x), std::max(std::abs(p.y), std::abs(p.z))));
+    shadow = Ray(trace.hitpos + bias * n, l, 0, light_distance - bias);
+    return true;
+}
+
+vec3 Renderer::compute_hit_color(const Ray& r, const trace_info& trace, const render_options& opts,
+                                 size_t steps, traversal_stats *stats) const
 {
     vec3 color(0.0, 0.0, 0.0);
     if (steps == 0) {
         return color;
     }
-    trace_info trace = m_bvh.trace_ray(r);
     if (trace.intersect_type == IntersectionType::Intersected) {
-        vec4 v, n; // View dir, normal
-        v = -r.dir;
-        n = trace.hitnorm;
 #ifdef BACKFACE_DIAGNOSTIC
                 if (glm::dot(trace.hitnorm, r.dir) > 0) {
                     std::cout << "Back facing trace" << std::endl;
@@ -227,26 +627,89 @@ vec3 Renderer::compute_ray_color(const Ray& r, const render_options& opts, size_
             color = vec3(trace.barycenter);
         } else {
             for (auto& baselight : m_lights) {
-                vec4 l, h; // Light dir, half dir
-                vec3 El; // Irradiance
-                switch (baselight->type()) {
-                    case LightType::Directional: {
-                        auto* light = dynamic_cast<DirectionalLight*>(baselight.get());
-                        El = light->color() * light->intensity();
-                        l = -light->direction();
-                    } break;
-                    case LightType::Point: {
-                        auto* light = dynamic_cast<PointLight*>(baselight.get());
-                        l = light->position() - trace.hitpos;
-                        scalar r2 = glm::dot(l, l);
-                        l = glm::normalize(l);
-                        El = light->color() * light->intensity() / r2;
-                    } break;
+                vec3 radiance;
+                Ray shadow;
+                if (sample_light(*baselight, trace, radiance, shadow) &&
+                        m_bvh.occluded(shadow, stats)) {
+                    continue;
                 }
-                h = glm::normalize(v + l);
-                color += glm::one_over_pi<scalar>() * vec3(1.0, 1.0, 1.0) * El * glm::dot(l,n);
+                color += radiance;
             }
         }
     }
     return color;
 }
+
+void Renderer::render_wavefront(wavefront_queues& q, const render_options& opts,
+                                traversal_stats *stats) const
+{
+    size_t count = q.primary.size();
+    // Primary rays, traced in packets of consecutive samples
+    q.hits.resize(count);
+    ray_packet packet;
+    for (size_t first = 0; first < count; first += RAY_PACKET_SIZE) {
+        packet.count = std::min(RAY_PACKET_SIZE, count - first);
+        for (size_t i = 0; i < packet.count; ++i) {
+            packet.rays[i] = q.primary.ray(first + i);
+        }
+        if (opts.packets) {
+            m_bvh.trace_packet(packet, &q.hits[first], stats);
+        } else {
+            for (size_t i = 0; i < packet.count; ++i) {
+                q.hits[first + i] = m_bvh.trace_ray(packet.rays[i], stats);
+            }
+        }
+    }
+
+    // Shade the hits grouped by mesh, queueing a shadow ray for each light sample
+    q.colors.assign(count, vec3(0.0, 0.0, 0.0));
+    q.sort_hits();
+    for (uint32_t i : q.order) {
+        const trace_info& trace = q.hits[i];
+        if (opts.max_recursion == 0 || trace.intersect_type != IntersectionType::Intersected) {
+            continue;
+        }
+        if (opts.debug_flags & (debug_mode::normal_coloring | debug_mode::interp_coloring)) {
+            q.colors[i] = compute_hit_color(q.primary.ray(i), trace, opts, opts.max_recursion,
+                                            stats);
+            continue;
+        }
+        for (auto& baselight : m_lights) {
+            vec3 radiance;
+            Ray shadow;
+            if (sample_light(*baselight, trace, radiance, shadow)) {
+                q.shadow.push(shadow, (uint32_t)q.radiance.size());
+            }
+            q.radiance.push_back(radiance);
+            q.owner.push_back(i);
+        }
+    }
+
+    // Shadow rays, binned by direction and origin so packets share a traversal
+    q.blocked.assign(q.radiance.size(), 0);
+    q.bin_shadow_rays();
+    for (size_t first = 0; first < q.shadow.size(); first += RAY_PACKET_SIZE) {
+        q.shadow.gather(q.order.data(), first, std::min(RAY_PACKET_SIZE, q.shadow.size() - first), packet);
+        uint32_t lanes = 0;
+        if (opts.packets) {
+            lanes = m_bvh.occluded_packet(packet, stats);
+        } else {
+            for (size_t i = 0; i < packet.count; ++i) {
+                lanes |= (uint32_t)m_bvh.occluded(packet.rays[i], stats) << i;
+            }
+        }
+        for (; lanes; lanes &= lanes - 1) {
+            q.blocked[q.shadow.source[q.order[first + __builtin_ctz(lanes)]]] = 1;
+        }
+    }
+
+    // Light samples are summed per sample in the order they were taken
+    for (size_t i = 0; i < q.radiance.size(); ++i) {
+        if (!q.blocked[i]) {
+            q.colors[q.owner[i]] += q.radiance[i];
+        }
+    }
+    for (auto& c : q.colors) {
+        c = glm::clamp(c, vec3(0.0, 0.0, 0.0), vec3(1.0, 1.0, 1.0));
+    }
+}
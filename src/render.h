@@ -26,11 +26,13 @@
 #include "trace.h"
 #include "scene.h"
 #include "bvh.h"
+#include "animation.h"
 
 #include <glm/mat4x4.hpp>
 #include <vector>
 #include <memory>
 #include <cstdint>
+#include <numeric>
 
 /**
  * Perform gamma correction, moving from linear colors to sRGB.
@@ -56,21 +58,76 @@ struct render_options {
     int debug_flags; // Select bitflags from debug_mode
     bool msaa; // Enable MSAA
     size_t max_recursion; // Maximum number of recursive steps in renderer
-    size_t concurrency; // Number of concurrent rendering jobs
+    bool bvh_report; // Count the BVH traversal work of each ray, and log the averages
+    bool packets; // Trace primary rays in packets of neighboring samples
+    bool wavefront; // Trace and shade each tile in stages, sorting the rays between stages
 };
 
+struct wavefront_queues;
+
 struct rgb_color {
     uint8_t r;
     uint8_t g;
     uint8_t b;
 };
 
+/** Size in bytes of a cache line */
+const static size_t CACHE_LINE_SIZE = 64;
+
+/**
+ * RGB image which render threads write into in place. The buffer starts on a cache line, and rows
+ * are padded so each one does too. Threads writing separate tiles then never share a cache line,
+ * as long as tile edges fall on multiples of FRAMEBUFFER_ROW_ALIGN pixels.
+ */
+class Framebuffer {
+    private:
+
+        struct aligned_delete {
+            void operator()(rgb_color *p) const;
+        };
+
+        size_t m_width, m_height;
+        size_t m_stride; // Pixels from the start of one row to the start of the next
+        std::unique_ptr<rgb_color, aligned_delete> m_pixels;
+
+    public:
+
+        /**
+         * Allocate an image. Pixels are left uninitialized.
+         */
+        Framebuffer(size_t width, size_t height);
+
+        size_t width() const { return m_width; }
+
+        size_t height() const { return m_height; }
+
+        size_t stride() const { return m_stride; }
+
+        rgb_color *row(size_t y) { return m_pixels.get() + y * m_stride; }
+
+        const rgb_color *row(size_t y) const { return m_pixels.get() + y * m_stride; }
+};
+
+/** Fewest pixels filling a whole number of cache lines. Framebuffer rows are padded to a multiple */
+const static size_t FRAMEBUFFER_ROW_ALIGN = CACHE_LINE_SIZE /
+    std::gcd(sizeof(rgb_color), CACHE_LINE_SIZE);
+
+/** Width in pixels of the tiles the image is split into for rendering */
+const static size_t RENDER_TILE_WIDTH = 64;
+
+/** Height in pixels of the tiles the image is split into for rendering */
+const static size_t RENDER_TILE_HEIGHT = 32;
+
+static_assert(RENDER_TILE_WIDTH % FRAMEBUFFER_ROW_ALIGN == 0,
+              "Tiles should cover whole cache lines of the framebuffer");
+
 class Camera {
     private:
 
         mat4 m_xform;
         scalar m_fov, m_aspect;
         bool m_is_fov_horizontal;
+        scalar m_near, m_far; // Clip plane distances along the view direction
 
     public:
 
@@ -85,11 +142,15 @@ class Camera {
          * @param xform Camera transform.
          * @param fov Vertical fov in radians.
          * @param aspect Aspect ratio given as width / height.
+         * @param near_plane Distance of the near clip plane along the view direction.
+         * @param far_plane Distance of the far clip plane along the view direction.
          */
-        Camera(mat4 xform, scalar fov, scalar aspect);
+        Camera(mat4 xform, scalar fov, scalar aspect, scalar near_plane = 0,
+               scalar far_plane = SCALAR_INF);
 
         /**
-         * Construct a camera from an assimp camera in the scene graph.
+         * Construct a camera from an assimp camera in the scene graph. The clip planes of the
+         * assimp camera are kept.
          *
          * @param scene Scene graph containing the camera.
          * @param camera Assimp camera object
@@ -120,7 +181,28 @@ class Camera {
         void set_aspect(scalar aspect, bool keep_vertical_fov=false);
 
         /**
-         * Compute a ray directed at a virtual screen.
+         * Vertical FOV in radians
+         */
+        scalar fov() const { return m_fov; }
+
+        scalar aspect() const { return m_aspect; }
+
+        scalar near_plane() const { return m_near; }
+
+        scalar far_plane() const { return m_far; }
+
+        /**
+         * Set the clip planes. Only geometry between the planes is visible to rays computed by the
+         * camera.
+         *
+         * @param near_plane Distance of the near clip plane along the view direction.
+         * @param far_plane Distance of the far clip plane along the view direction.
+         */
+        void set_clip_planes(scalar near_plane, scalar far_plane);
+
+        /**
+         * Compute a ray directed at a virtual screen. The interval of the ray covers the part
+         * between the clip planes.
          *
          * @param pos Position of the ray on the screen from [-1,1]. (-1, -1) lies at the top left, and
          * (1, 1) lies at the bottom right.
@@ -128,45 +210,133 @@ class Camera {
         Ray compute_ray(vec2 pos) const;
 };
 
+/**
+ * Primary rays of a rectangle of samples, in structure of arrays form and row major order. Every
+ * ray starts at the camera origin.
+ */
+struct primary_rays {
+    vec4 origin;
+    std::vector<scalar> dir_x, dir_y, dir_z;
+    std::vector<scalar> tmin, tmax;
+
+    size_t size() const { return dir_x.size(); }
+
+    Ray ray(size_t i) const
+    {
+        return Ray(origin, vec4(dir_x[i], dir_y[i], dir_z[i], 0.0), tmin[i], tmax[i]);
+    }
+};
+
+/**
+ * Generates the primary rays of a frame. The camera basis, and the screen position of every
+ * column and row of samples, are computed once when the generator is made. Gives the same rays as
+ * Camera::compute_ray.
+ */
+class RayGenerator {
+    private:
+
+        vec4 m_origin;
+        vec4 m_right, m_up, m_back; // Camera axes in world space
+        scalar m_near, m_far;
+        std::vector<scalar> m_screen_x; // View space x of each column of samples
+        std::vector<scalar> m_screen_y; // View space y of each row of samples
+
+    public:
+
+        /**
+         * Prepare to generate rays for a frame.
+         *
+         * @param cam Camera from which the frame is rendered.
+         * @param sample_width Width of the frame in samples.
+         * @param sample_height Height of the frame in samples.
+         */
+        RayGenerator(const Camera& cam, size_t sample_width, size_t sample_height);
+
+        /**
+         * Generate the rays of a rectangle of samples.
+         *
+         * @param x Column of the first sample.
+         * @param y Row of the first sample.
+         * @param width Width of the rectangle in samples.
+         * @param height Height of the rectangle in samples.
+         * @param out Receives the rays, replacing its contents.
+         */
+        void generate(size_t x, size_t y, size_t width, size_t height, primary_rays& out) const;
+};
+
 class Renderer {
     private:
 
         const Scene& m_scene;
         BVH m_bvh;
         const std::vector<std::unique_ptr<Light>> m_lights;
+        TaskScheduler *m_scheduler;
 
     public:
 
-        Renderer(const Scene& scene_graph, std::vector<std::unique_ptr<Light>> lights);
+        /**
+         * @param scheduler Runs the BVH build and rendering in parallel. If null, everything runs
+         * on the calling thread.
+         */
+        Renderer(const Scene& scene_graph, std::vector<std::unique_ptr<Light>> lights,
+                const bvh_options& bvh_opts = bvh_options(), TaskScheduler *scheduler = nullptr);
 
         ~Renderer() {}
 
+        /**
+         * Move the scene to a point in an animation. The BVH is refit rather than rebuilt where
+         * possible, so frames of a sequence can be rendered back to back cheaply.
+         *
+         * @param time Time in seconds from the start of the animation.
+         */
+        void update(const SceneAnimation& animation, double time);
+
         /**
          * Render the scene using a recursive ray-tracing method.
          *
          * @param cam Camera from which to render the scene.
          * @param opts Additional options for the renderer, such as resolution.
-         * @return Raw RGB image data.
+         * @return Rendered image.
          */
-        std::vector<rgb_color> render(Camera& cam, render_options opts) const;
+        Framebuffer render(Camera& cam, render_options opts) const;
 
         /**
-         * Render a subset of the scene using recursive ray-tracing.
+         * Render a tile of the image using recursive ray-tracing.
          *
-         * @param data Output RGB image data. Data is formatted using range width/height, no blank
-         * space is left for the final image.
-         * @param cam Camera from which to render the scene.
+         * @param image Image the tile is written into, in place.
+         * @param rays Generator of the primary rays of the frame.
          * @param opts Additional options for the renderer.
-         * @param x Starting x position of the range.
-         * @param y Starting y position of the range.
-         * @param width Width of the range. x + width must not exceed the final render width.
-         * @param height Height of the range. y + height must not exceed the final render height.
+         * @param x Starting x position of the tile.
+         * @param y Starting y position of the tile.
+         * @param width Width of the tile, no more than RENDER_TILE_WIDTH. x + width must not exceed
+         * the final render width.
+         * @param height Height of the tile. y + height must not exceed the final render height.
+         * @param block_rays Scratch space for the primary rays of a row of blocks. Reused from
+         * tile to tile, so it's only allocated once per render thread.
+         * @param queues Scratch space for wavefront mode, reused in the same way.
+         * @param stats Receives the BVH traversal work of the rays traced. May be null.
          */
-        void render_range(  std::vector<rgb_color>& data,
-                            const Camera& cam,
+        void render_tile(   Framebuffer& image,
+                            const RayGenerator& rays,
                             const render_options& opts,
                             uint16_t x, uint16_t y,
-                            uint16_t width, uint16_t height) const;
+                            uint16_t width, uint16_t height,
+                            primary_rays& block_rays,
+                            wavefront_queues& queues,
+                            traversal_stats *stats = nullptr) const;
+
+        /**
+         * Trace and shade a batch of primary rays in stages, rather than one ray at a time. Each
+         * stage runs over the whole batch, with its rays sorted for coherence, before the next
+         * one starts.
+         *
+         * @param queues Queues holding the batch of primary rays. Receives the clamped color of
+         * each ray.
+         * @param opts Options for the renderer, which may affect lighting computation.
+         * @param stats Receives the BVH traversal work of the rays traced. May be null.
+         */
+        void render_wavefront(wavefront_queues& queues, const render_options& opts,
+                              traversal_stats *stats = nullptr) const;
 
         /**
          * Compute the color of a ray of light traveling through the scene.
@@ -174,6 +344,21 @@ class Renderer {
          * @param ray Ray opposing the ray of light in question.
          * @param opts Options for the renderer, which may affect lighting computation.
          * @param steps Number of recursive steps taken to compute reflections.
+         * @param stats Receives the BVH traversal work of the ray. May be null.
+         */
+        vec3 compute_ray_color(const Ray& r, const render_options& opts, size_t steps,
+                               traversal_stats *stats = nullptr) const;
+
+        /**
+         * Compute the color of a ray of light, given the first intersection of the opposing ray
+         * with the scene. Lets rays traced in packets be shaded one at a time.
+         *
+         * @param ray Ray opposing the ray of light in question.
+         * @param trace First intersection of the ray with the scene.
+         * @param opts Options for the renderer, which may affect lighting computation.
+         * @param steps Number of recursive steps taken to compute reflections.
+         * @param stats Receives the BVH traversal work of rays cast while shading. May be null.
          */
-        vec3 compute_ray_color(const Ray& r, const render_options& opts, size_t steps) const;
+        vec3 compute_hit_color(const Ray& r, const trace_info& trace, const render_options& opts,
+                               size_t steps, traversal_stats *stats = nullptr) const;
 };
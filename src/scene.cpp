@@ -20,14 +20,16 @@
  */
 
 #include "scene.h"
+#include "scheduler.h"
 #include <iostream>
 #include <iomanip>
+#include <cstdint>
 #include <assimp/config.h>
 #include <assimp/postprocess.h>
 
 Scene::Scene() : m_scene(nullptr) {}
 
-Scene::Scene(std::string& file)
+Scene::Scene(std::string& file, TaskScheduler *scheduler)
 {
     m_data.SetPropertyInteger(AI_CONFIG_PP_SBP_REMOVE, aiPrimitiveType_POINT | aiPrimitiveType_LINE);
     m_scene = m_data.ReadFile(file,
@@ -35,23 +37,28 @@ Scene::Scene(std::string& file)
             aiProcess_Triangulate |
             aiProcess_SortByPType);
     if (m_scene != nullptr) {
-        process_meshes();
+        process_meshes(scheduler);
     }
 }
 
-void Scene::process_meshes()
+void Scene::process_meshes(TaskScheduler *scheduler)
 {
-    m_mesh_list.reserve(m_scene->mNumMeshes);
+    m_mesh_list.resize(m_scene->mNumMeshes);
+    // Flags rather than vector<bool>, so separate threads may set them at once
+    std::vector<uint8_t> failed(m_scene->mNumMeshes);
+    parallel_for(scheduler, m_scene->mNumMeshes, 1, [&](size_t i) {
+            try {
+                m_mesh_list[i] = Mesh(*m_scene->mMeshes[i]);
+            } catch (std::invalid_argument& ex) {
+                // If mesh processing fails, keep the empty placeholder mesh.
+                failed[i] = 1;
+            }
+        });
     for (unsigned int i = 0; i < m_scene->mNumMeshes; ++i) {
-        Mesh m;
-        try {
-            m = Mesh(*m_scene->mMeshes[i]);
-        } catch (std::invalid_argument& ex) {
+        if (failed[i]) {
             std::cout << "Processing of mesh "
                 << std::quoted(m_scene->mMeshes[i]->mName.C_Str())
                 << " failed" << std::endl;
-            m = Mesh(); // If mesh processing fails, make an empty placeholder mesh.
         }
-        m_mesh_list.emplace_back(std::move(m));
     }
 }
@@ -25,6 +25,8 @@
 #include <assimp/scene.h>
 #include <assimp/Importer.hpp>
 
+class TaskScheduler;
+
 class Scene {
     private:
 
@@ -32,7 +34,7 @@ class Scene {
         const aiScene *m_scene;
         std::vector<Mesh> m_mesh_list;
 
-        void process_meshes();
+        void process_meshes(TaskScheduler *scheduler);
 
     public:
 
@@ -43,8 +45,11 @@ class Scene {
 
         /**
          * Load a scene from a file.
+         *
+         * @param scheduler Converts meshes in parallel. If null, they're converted on the calling
+         * thread.
          */
-        Scene(std::string& file);
+        Scene(std::string& file, TaskScheduler *scheduler = nullptr);
 
         /**
          * Get the assimp scene backing this scene.
@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2018 Matt Monsour
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "scheduler.h"
+
+TaskScheduler::TaskScheduler(size_t threads) :
+    m_stopping(false)
+{
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    for (size_t t = 1; t < threads; ++t) {
+        m_workers.emplace_back([this]() {
+                run_until([this]() { return m_stopping && m_tasks.empty(); });
+            });
+    }
+}
+
+TaskScheduler::~TaskScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_changed.notify_all();
+    for (auto& w : m_workers) {
+        w.join();
+    }
+}
+
+void TaskScheduler::submit(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+    m_changed.notify_all();
+}
+
+void TaskScheduler::run_until(const std::function<bool()>& done)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!done()) {
+        if (m_tasks.empty()) {
+            m_changed.wait(lock);
+            continue;
+        }
+        auto task = std::move(m_tasks.front());
+        m_tasks.pop_front();
+        lock.unlock();
+        task();
+        lock.lock();
+    }
+}
+
+TaskGroup::TaskGroup(TaskScheduler *scheduler) :
+    m_scheduler(scheduler),
+    m_pending(0)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+    if (m_scheduler != nullptr) {
+        m_scheduler->run_until([this]() { return m_pending == 0; });
+    }
+}
+
+void TaskGroup::run(std::function<void()> task)
+{
+    if (m_scheduler == nullptr) {
+        try {
+            task();
+        } catch (...) {
+            if (!m_error) {
+                m_error = std::current_exception();
+            }
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(m_scheduler->m_mutex);
+        m_pending++;
+    }
+    m_scheduler->submit([this, scheduler = m_scheduler, task = std::move(task)]() {
+            std::exception_ptr error;
+            try {
+                task();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            // Signal with the lock held, since the group may be gone as soon as it's released
+            std::lock_guard<std::mutex> lock(scheduler->m_mutex);
+            if (error && !m_error) {
+                m_error = error;
+            }
+            m_pending--;
+            scheduler->m_changed.notify_all();
+        });
+}
+
+void TaskGroup::wait()
+{
+    if (m_scheduler != nullptr) {
+        m_scheduler->run_until([this]() { return m_pending == 0; });
+    }
+    std::exception_ptr error;
+    std::swap(error, m_error);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2018 Matt Monsour
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <algorithm>
+
+/**
+ * Pool of threads shared by every parallel part of the program: loading the scene, building the
+ * BVH, rendering and encoding images. Threads are started once and wait for tasks in between, so
+ * frames and phases don't pay for starting threads.
+ *
+ * A thread waiting on a TaskGroup runs queued tasks until the group is done, so tasks may split
+ * their work into more tasks and wait on them without tying up threads.
+ */
+class TaskScheduler {
+    private:
+
+        std::vector<std::thread> m_workers;
+        std::deque<std::function<void()>> m_tasks;
+        std::mutex m_mutex;
+        std::condition_variable m_changed; // Signaled when a task is queued or finishes
+        bool m_stopping;
+
+        friend class TaskGroup;
+
+        /**
+         * Queue a task, to be run by a worker or a waiting thread.
+         */
+        void submit(std::function<void()> task);
+
+        /**
+         * Run queued tasks until a condition holds, sleeping while none are queued.
+         *
+         * @param done Checked with the lock held, before each task and after each wakeup.
+         */
+        void run_until(const std::function<bool()>& done);
+
+    public:
+
+        /**
+         * Start a scheduler.
+         *
+         * @param threads Total number of threads running tasks, including the thread which waits
+         * on them. One fewer workers are started. 0 uses the number of hardware threads.
+         */
+        TaskScheduler(size_t threads);
+
+        /**
+         * Stop the workers, once every queued task has run.
+         */
+        ~TaskScheduler();
+
+        TaskScheduler(const TaskScheduler&) = delete;
+        TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+        /**
+         * Number of threads running tasks, including the waiting thread.
+         */
+        size_t concurrency() const { return m_workers.size() + 1; }
+};
+
+/**
+ * Tasks run on a scheduler which are waited on together. If a task throws, the first exception
+ * is rethrown by wait.
+ */
+class TaskGroup {
+    private:
+
+        TaskScheduler *m_scheduler;
+        size_t m_pending; // Guarded by the scheduler mutex
+        std::exception_ptr m_error; // Guarded by the scheduler mutex
+
+    public:
+
+        /**
+         * Construct a group of tasks.
+         *
+         * @param scheduler Scheduler the tasks run on. If null, tasks run immediately on the
+         * calling thread.
+         */
+        TaskGroup(TaskScheduler *scheduler);
+
+        /**
+         * Wait for the tasks still running. Exceptions they threw are dropped.
+         */
+        ~TaskGroup();
+
+        TaskGroup(const TaskGroup&) = delete;
+        TaskGroup& operator=(const TaskGroup&) = delete;
+
+        /**
+         * Start a task in the group.
+         */
+        void run(std::function<void()> task);
+
+        /**
+         * Wait for every task started in the group, running queued tasks meanwhile.
+         */
+        void wait();
+};
+
+/**
+ * Run a function over each index in [0, count), spread over the threads of a scheduler. Indices
+ * are handed out in chunks as threads become free, so uneven work is balanced.
+ *
+ * @param scheduler Scheduler to run on. If null, every index is run on the calling thread.
+ * @param grain Number of consecutive indices handed to a thread at once.
+ */
+template <typename Fn>
+void parallel_for(TaskScheduler *scheduler, size_t count, size_t grain, Fn fn)
+{
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next.fetch_add(grain); i < count; i = next.fetch_add(grain)) {
+            for (size_t j = i; j < std::min(i + grain, count); ++j) {
+                fn(j);
+            }
+        }
+    };
+    size_t chunks = (count + grain - 1) / grain;
+    size_t helpers = scheduler != nullptr ? std::min(scheduler->concurrency(), chunks) : 1;
+    TaskGroup group(scheduler);
+    for (size_t t = 1; t < helpers; ++t) {
+        group.run(worker);
+    }
+    worker();
+    group.wait();
+}
@@ -21,125 +21,378 @@
 
 #include "trace.h"
 #include "const.h"
-#include <glm/mat2x2.hpp>
 #include <glm/geometric.hpp>
 #include <algorithm>
+#include <cmath>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-const static scalar ERROR_THOLD = 0.00005;
+watertight_ray::watertight_ray(const Ray& r)
+{
+    vec3 d(r.dir);
+    vec3 mag = glm::abs(d);
+    kz = mag.x > mag.y ? (mag.x > mag.z ? 0 : 2) : (mag.y > mag.z ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if (d[kz] < 0) {
+        // Keep the winding of triangles, so edge functions keep their signs
+        std::swap(kx, ky);
+    }
+    sx = d[kx] / d[kz];
+    sy = d[ky] / d[kz];
+    sz = 1 / d[kz];
+}
+
+traversal_ray::traversal_ray(const Ray& r) :
+    origin(r.origin),
+    tmin(r.tmin),
+    tmax(r.tmax)
+{
+    for (int c = 0; c < 3; ++c) {
+        scalar d = r.dir[c];
+        sign[c] = std::signbit(d) ? 1 : 0;
+        if (std::abs(d) < (scalar)1e-20) {
+            d = sign[c] ? (scalar)-1e-20 : (scalar)1e-20;
+        }
+        inv_dir[c] = 1 / d;
+    }
+}
 
-Ray::Ray(vec4 origin, vec4 dir) :
+Ray::Ray() :
+    tmin(0),
+    tmax(SCALAR_INF) {}
+
+Ray::Ray(vec4 origin, vec4 dir, scalar tmin, scalar tmax) :
     origin(origin),
-    dir(dir) {}
+    dir(dir),
+    tmin(tmin),
+    tmax(tmax) {}
 
 trace_result Ray::intersect_aabb(const aabb& volume) const
 {
     trace_result result;
-    result.distance = -SCALAR_INF;
-    scalar tmin, tmax;
-    tmin = -SCALAR_INF;
-    tmax = SCALAR_INF;
-    vec3 half = (volume.max - volume.min) * (scalar)0.5;
-    vec3 center = (volume.max + volume.min) * (scalar)0.5;
-    vec3 p = center - vec3(this->origin);
-    for (int c = 0; c < 3; ++c) {
-        scalar e = p[c];
-        scalar f = this->dir[c];
-        // TODO Pick an epsilon to negate precision errors
-        if (glm::abs(f) > 0) {
-            scalar inv_f = 1/f;
-            scalar t1 = (e + half[c]) * inv_f;
-            scalar t2 = (e - half[c]) * inv_f;
-            if (t1 > t2) {
-                std::swap(t1, t2);
-            }
-            if (t1 > tmin) {
-                tmin = t1;
-            }
-            if (t2 < tmax) {
-                tmax = t2;
-            }
-            if (tmin > tmax) {
-                // Ray misses AABB
-                result.intersect_type = IntersectionType::None;
-                return result;
-            }
-            if (tmax < 0) {
-                // Intersection lies behind ray
-                result.intersect_type = IntersectionType::BehindRay;
-                return result;
-            }
-        } else if (-e - half[c] > 0 || -e + half[c] < 0) {
-            // Ray lies parallel, but not within the AABB
-            result.intersect_type = IntersectionType::None;
-            return result;
-        }
-    }
-    if (tmin > 0) {
+    scalar tnear;
+    if (!traversal_ray(*this).intersect_aabb(volume, this->tmax, tnear)) {
+        result.intersect_type = IntersectionType::None;
+        result.distance = -SCALAR_INF;
+    } else if (tnear > this->tmin) {
         result.intersect_type = IntersectionType::Intersected;
-        result.distance = tmin;
+        result.distance = tnear;
     } else {
-        // Ray is inside AABB; return origin, or tmax?
+        // Start of the ray is inside AABB
         result.intersect_type = IntersectionType::InsideVolume;
-        result.distance = 0;
+        result.distance = tnear;
     }
     return result;
 }
 
-trace_info Ray::intersect_mesh(const MeshInstance& obj) const
+/**
+ * Watertight test of Woop, Benthin and Wald, 2013. Shared by the closest hit and any hit tests.
+ *
+ * @param t Receives the distance of the hit along the ray.
+ * @param uvw Receives the barycentrics of the hit, scaled by the determinant.
+ * @param inv_det Receives the inverse of the determinant.
+ * @return True if the triangle is hit no closer than the start of the ray, and no further than
+ * max_distance.
+ */
+static bool watertight_hit(const Ray& r, const Mesh::triangle_record& rec, const watertight_ray& wr,
+                           scalar max_distance, scalar& t, vec3& uvw, scalar& inv_det)
+{
+    vec3 o(r.origin);
+    vec3 a = rec.p0 - o;
+    vec3 b = rec.p1 - o;
+    vec3 c = rec.p2 - o;
+    scalar ax = a[wr.kx] - wr.sx * a[wr.kz];
+    scalar ay = a[wr.ky] - wr.sy * a[wr.kz];
+    scalar bx = b[wr.kx] - wr.sx * b[wr.kz];
+    scalar by = b[wr.ky] - wr.sy * b[wr.kz];
+    scalar cx = c[wr.kx] - wr.sx * c[wr.kz];
+    scalar cy = c[wr.ky] - wr.sy * c[wr.kz];
+    scalar u = cx * by - cy * bx;
+    scalar v = ax * cy - ay * cx;
+    scalar w = bx * ay - by * ax;
+#ifndef USE_DOUBLE_PRECISION
+    if (u == 0 || v == 0 || w == 0) {
+        // Ray passes too close to an edge for single precision to decide the side
+        u = (float)((double)cx * by - (double)cy * bx);
+        v = (float)((double)ax * cy - (double)ay * cx);
+        w = (float)((double)bx * ay - (double)by * ax);
+    }
+#endif
+    if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) {
+        return false;
+    }
+    scalar det = u + v + w;
+    if (det == 0) {
+        // Ray lies in the plane of the triangle
+        return false;
+    }
+    scalar az = wr.sz * a[wr.kz];
+    scalar bz = wr.sz * b[wr.kz];
+    scalar cz = wr.sz * c[wr.kz];
+    inv_det = 1 / det;
+    t = (u * az + v * bz + w * cz) * inv_det;
+    if (!(t >= r.tmin) || t > max_distance) {
+        // Plane intersects behind ray, or lies behind best trace
+        return false;
+    }
+    uvw = vec3(u, v, w);
+    return true;
+}
+
+bool Ray::intersect_triangle(const Mesh::Triangle& tri, trace_info& info) const
+{
+    return intersect_triangle(tri, watertight_ray(*this), info);
+}
+
+bool Ray::intersect_triangle(const Mesh::Triangle& tri, const watertight_ray& wr,
+                             trace_info& info) const
+{
+    scalar t, inv_det;
+    vec3 uvw;
+    if (!watertight_hit(*this, tri.record(), wr, std::min(info.distance, this->tmax), t, uvw,
+                        inv_det)) {
+        return false;
+    }
+    info.intersect_type = IntersectionType::Intersected;
+    info.hitpos = this->origin + t * this->dir;
+    info.barycenter = uvw * inv_det;
+    info.hitnorm = tri.surface_normal(info.barycenter);
+    info.distance = t;
+    return true;
+}
+
+bool Ray::intersect_any(const Mesh::Triangle& tri, const watertight_ray& wr) const
+{
+    scalar t, inv_det;
+    vec3 uvw;
+    return watertight_hit(*this, tri.record(), wr, this->tmax, t, uvw, inv_det);
+}
+
+trace_info Ray::intersect_mesh(const MeshInstance& obj, const MeshBVH& accel,
+                               scalar max_distance, traversal_stats *stats) const
+{
+    auto& to_obj = obj.inverse_transform();
+    // Cast ray in object space. Distances along the ray are preserved by the transform.
+    Ray local(to_obj * this->origin, to_obj * this->dir, this->tmin, this->tmax);
+    return intersect_mesh(obj, accel, local, max_distance, stats);
+}
+
+trace_info Ray::intersect_mesh(const MeshInstance& obj, const MeshBVH& accel, const Ray& local,
+                               scalar max_distance, traversal_stats *stats) const
 {
     trace_info info;
     info.intersect_type = IntersectionType::None;
     info.hitobj = nullptr;
-    //scalar best_d = SCALAR_INF;
     auto& to_world = obj.transform();
-    auto& to_obj = obj.inverse_transform();
-    // Cast ray in object space
-    vec4 origin = to_obj * this->origin;
-    vec4 dir = to_obj * this->dir;
-    info.distance = SCALAR_INF;
-    for (auto& tri : obj.mesh().triangles()) {
-        scalar t;
-        auto& p0 = tri.p0();
-        auto& p1 = tri.p1();
-        auto& p2 = tri.p2();
-        auto& norm = tri.plane_normal();
-        // Compute plane intersection
-        vec4 plane(vec3(norm), -glm::dot(norm, p0));
-        t = -glm::dot(plane, origin) / glm::dot(plane, dir);
-        if (t < 0 || t > info.distance) {
-            // Plane intersects behind ray, or lies behind best trace
-            continue;
-        }
-        // Compute barycenter
-        vec4 pout = origin + t * dir;
-        vec4 r, q1, q2;
-        scalar q1q1, q1q2, q2q2;
-        vec2 w, rq;
-        mat2 qmat;
-        r = pout - p0;
-        q1 = p1 - p0;
-        q2 = p2 - p0;
-        q1q1 = glm::dot(q1, q1);
-        q2q2 = glm::dot(q2, q2);
-        q1q2 = glm::dot(q1, q2);
-        rq = vec2(glm::dot(r,q1), glm::dot(r,q2));
-        qmat[0][0] = q2q2;
-        qmat[0][1] = -q1q2;
-        qmat[1][0] = -q1q2;
-        qmat[1][1] = q1q1;
-        qmat =  (((scalar)1.0) / (q1q1 * q2q2 - q1q2 * q1q2)) * qmat;
-        w = qmat * rq;
-        if (w.x >= 0.0 - ERROR_THOLD && w.y >= 0.0 - ERROR_THOLD && w.x + w.y <= 1.0 + ERROR_THOLD) {
-            // Barycenter is valid; Point lies within triangle
-            info.intersect_type = IntersectionType::Intersected;
-            info.hitobj = &obj;
-            info.hitpos = pout;
-            info.barycenter = vec3((scalar)1.0 - w.x - w.y, w.x, w.y);
-            info.hitnorm = tri.surface_normal(info.barycenter);
-            info.distance = t;
-        }
+    info.distance = std::min(max_distance, local.tmax);
+    if (accel.trace_ray(local, info, stats)) {
+        info.hitobj = &obj;
     }
     info.hitpos = to_world * info.hitpos;
     info.hitnorm = glm::normalize(to_world * info.hitnorm);
     return info;
 }
+
+bool Ray::intersect_any(const MeshInstance& obj, const MeshBVH& accel,
+                        traversal_stats *stats) const
+{
+    auto& to_obj = obj.inverse_transform();
+    Ray local(to_obj * this->origin, to_obj * this->dir, this->tmin, this->tmax);
+    return accel.occluded(local, stats);
+}
+
+bool ray_packet::coherent() const
+{
+    for (int c = 0; c < 3; ++c) {
+        for (size_t i = 1; i < count; ++i) {
+            if (std::signbit(rays[i].dir[c]) != std::signbit(rays[0].dir[c])) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+ObjectRayCache::ObjectRayCache(const Ray& r) :
+    m_ray(r)
+{
+    std::fill(m_ids, m_ids + OBJECT_RAY_CACHE_SIZE, NO_TRANSFORM);
+}
+
+#if defined(__SSE2__) && !defined(USE_DOUBLE_PRECISION)
+/**
+ * Operations on a SIMD register holding one float per triangle of a packet, so the packet test is
+ * only written once.
+ */
+struct packet_lanes {
+#if defined(__AVX__)
+    typedef __m256 type;
+    static type set1(float v) { return _mm256_set1_ps(v); }
+    static type load(const float *p) { return _mm256_load_ps(p); }
+    static void store(float *p, type a) { _mm256_store_ps(p, a); }
+    static type add(type a, type b) { return _mm256_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+    static type div(type a, type b) { return _mm256_div_ps(a, b); }
+    static type lt(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static type gt(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static type le(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static type ge(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static type eq(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+    static type neq(type a, type b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_OQ); }
+    static type bit_and(type a, type b) { return _mm256_and_ps(a, b); }
+    static type bit_or(type a, type b) { return _mm256_or_ps(a, b); }
+    static unsigned int mask(type a) { return _mm256_movemask_ps(a); }
+#else
+    typedef __m128 type;
+    static type set1(float v) { return _mm_set1_ps(v); }
+    static type load(const float *p) { return _mm_load_ps(p); }
+    static void store(float *p, type a) { _mm_store_ps(p, a); }
+    static type add(type a, type b) { return _mm_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm_mul_ps(a, b); }
+    static type div(type a, type b) { return _mm_div_ps(a, b); }
+    static type lt(type a, type b) { return _mm_cmplt_ps(a, b); }
+    static type gt(type a, type b) { return _mm_cmpgt_ps(a, b); }
+    static type le(type a, type b) { return _mm_cmple_ps(a, b); }
+    static type ge(type a, type b) { return _mm_cmpge_ps(a, b); }
+    static type eq(type a, type b) { return _mm_cmpeq_ps(a, b); }
+    static type neq(type a, type b) { return _mm_and_ps(_mm_cmpneq_ps(a, b), _mm_cmpord_ps(a, b)); }
+    static type bit_and(type a, type b) { return _mm_and_ps(a, b); }
+    static type bit_or(type a, type b) { return _mm_or_ps(a, b); }
+    static unsigned int mask(type a) { return _mm_movemask_ps(a); }
+#endif
+};
+
+/**
+ * Lanes of a packet test, kept in registers until the caller decides which lanes it needs.
+ */
+struct packet_test {
+    packet_lanes::type t, u, v, w, inv_det;
+    unsigned int hits; // Lanes hit between the start of the ray and the max distance
+    unsigned int on_edge; // Lanes too close to an edge to decide in single precision
+
+    packet_test(const Ray& r, const triangle_packet& packet, size_t count,
+                const watertight_ray& wr, scalar max_distance);
+};
+
+packet_test::packet_test(const Ray& r, const triangle_packet& packet, size_t count,
+                         const watertight_ray& wr, scalar max_distance)
+{
+    typedef packet_lanes L;
+    const size_t P = TRIANGLE_PACKET_SIZE;
+    // Same steps as watertight_hit, so each lane rounds exactly like the single triangle test
+    L::type okx = L::set1(r.origin[wr.kx]);
+    L::type oky = L::set1(r.origin[wr.ky]);
+    L::type okz = L::set1(r.origin[wr.kz]);
+    L::type sx = L::set1(wr.sx);
+    L::type sy = L::set1(wr.sy);
+    L::type sz = L::set1(wr.sz);
+    L::type zero = L::set1(0);
+    auto shear = [&](const float (&p)[3][P], L::type& x, L::type& y, L::type& z) {
+        z = L::sub(L::load(p[wr.kz]), okz);
+        x = L::sub(L::sub(L::load(p[wr.kx]), okx), L::mul(sx, z));
+        y = L::sub(L::sub(L::load(p[wr.ky]), oky), L::mul(sy, z));
+    };
+    L::type ax, ay, az, bx, by, bz, cx, cy, cz;
+    shear(packet.p0, ax, ay, az);
+    shear(packet.p1, bx, by, bz);
+    shear(packet.p2, cx, cy, cz);
+    u = L::sub(L::mul(cx, by), L::mul(cy, bx));
+    v = L::sub(L::mul(ax, cy), L::mul(ay, cx));
+    w = L::sub(L::mul(bx, ay), L::mul(by, ax));
+    L::type det = L::add(L::add(u, v), w);
+    inv_det = L::div(L::set1(1), det);
+    t = L::mul(L::add(L::add(L::mul(u, L::mul(sz, az)), L::mul(v, L::mul(sz, bz))),
+                L::mul(w, L::mul(sz, cz))), inv_det);
+    unsigned int lanes = (1u << count) - 1;
+    on_edge = L::mask(L::bit_or(L::eq(u, zero), L::bit_or(L::eq(v, zero),
+                    L::eq(w, zero)))) & lanes;
+    unsigned int outside = L::mask(L::bit_and(
+                L::bit_or(L::lt(u, zero), L::bit_or(L::lt(v, zero), L::lt(w, zero))),
+                L::bit_or(L::gt(u, zero), L::bit_or(L::gt(v, zero), L::gt(w, zero)))));
+    unsigned int in_range = L::mask(L::bit_and(L::neq(det, zero),
+                L::bit_and(L::ge(t, L::set1(r.tmin)), L::le(t, L::set1(max_distance)))));
+    hits = in_range & ~outside & ~on_edge & lanes;
+}
+
+bool Ray::intersect_triangles(const triangle_packet& packet, size_t count, const Mesh& mesh,
+                              const watertight_ray& wr, trace_info& info) const
+{
+    typedef packet_lanes L;
+    const size_t P = TRIANGLE_PACKET_SIZE;
+    packet_test test(*this, packet, count, wr, std::min(info.distance, this->tmax));
+    bool hit = false;
+    if (test.hits != 0) {
+        alignas(32) float lane_t[P], lane_u[P], lane_v[P], lane_w[P], lane_inv[P];
+        L::store(lane_t, test.t);
+        L::store(lane_u, test.u);
+        L::store(lane_v, test.v);
+        L::store(lane_w, test.w);
+        L::store(lane_inv, test.inv_det);
+        size_t best = P;
+        for (size_t i = 0; i < count; ++i) {
+            if ((test.hits & (1u << i)) && (best == P || lane_t[i] <= lane_t[best])) {
+                best = i;
+            }
+        }
+        Mesh::Triangle tri(&mesh, packet.face[best]);
+        info.intersect_type = IntersectionType::Intersected;
+        info.hitpos = this->origin + lane_t[best] * this->dir;
+        info.barycenter = vec3(lane_u[best] * lane_inv[best], lane_v[best] * lane_inv[best],
+                lane_w[best] * lane_inv[best]);
+        info.hitnorm = tri.surface_normal(info.barycenter);
+        info.distance = lane_t[best];
+        hit = true;
+    }
+    // Lanes too close to an edge to decide in single precision take the exact path
+    unsigned int on_edge = test.on_edge;
+    for (size_t i = 0; on_edge != 0; ++i, on_edge >>= 1) {
+        if ((on_edge & 1) && intersect_triangle(Mesh::Triangle(&mesh, packet.face[i]), wr, info)) {
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+bool Ray::intersect_any(const triangle_packet& packet, size_t count, const Mesh& mesh,
+                        const watertight_ray& wr) const
+{
+    packet_test test(*this, packet, count, wr, this->tmax);
+    if (test.hits != 0) {
+        return true;
+    }
+    unsigned int on_edge = test.on_edge;
+    for (size_t i = 0; on_edge != 0; ++i, on_edge >>= 1) {
+        if ((on_edge & 1) && intersect_any(Mesh::Triangle(&mesh, packet.face[i]), wr)) {
+            return true;
+        }
+    }
+    return false;
+}
+#else
+bool Ray::intersect_triangles(const triangle_packet& packet, size_t count, const Mesh& mesh,
+                              const watertight_ray& wr, trace_info& info) const
+{
+    bool hit = false;
+    for (size_t i = 0; i < count; ++i) {
+        if (intersect_triangle(Mesh::Triangle(&mesh, packet.face[i]), wr, info)) {
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+bool Ray::intersect_any(const triangle_packet& packet, size_t count, const Mesh& mesh,
+                        const watertight_ray& wr) const
+{
+    for (size_t i = 0; i < count; ++i) {
+        if (intersect_any(Mesh::Triangle(&mesh, packet.face[i]), wr)) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
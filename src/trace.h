@@ -25,9 +25,12 @@
 #include "types.h"
 #include "model.h"
 #include "bvh.h"
+#include "const.h"
 
 #include <glm/vec4.hpp>
 #include <glm/vec3.hpp>
+#include <algorithm>
+#include <cstdint>
 
 enum struct IntersectionType {
     None, /// No intersection occurred.
@@ -65,28 +68,222 @@ struct trace_result
     scalar distance;
 };
 
+class Ray;
+
+/**
+ * Ray prepared for watertight triangle tests. Triangles are transformed into a space where the ray
+ * starts at the origin and points down the z axis, so every test reduces to 2D edge functions
+ * evaluated the same way for both triangles sharing an edge.
+ */
+struct watertight_ray {
+    int kx, ky, kz; // Axes permuted so z is the largest component of the direction
+    scalar sx, sy, sz; // Shear mapping the direction onto the z axis
+
+    /**
+     * Construct an unprepared ray, to be assigned a prepared one later.
+     */
+    watertight_ray() {}
+
+    watertight_ray(const Ray& r);
+};
+
+/**
+ * Ray prepared for traversing bounding volumes. The reciprocal direction and direction signs are
+ * computed once per ray, so each slab test needs no divisions or branches.
+ */
+struct traversal_ray {
+    vec3 origin;
+    vec3 inv_dir; // Kept finite, so slab tests never multiply zero by infinity
+    int sign[3]; // 1 on axes where the direction is negative, picking the near plane of each slab
+    scalar tmin, tmax;
+
+    traversal_ray(const Ray& r);
+
+    /**
+     * Test intersection vs an AABB, within [tmin, min(tmax, max_distance)].
+     *
+     * @param tnear Receives the distance the ray enters the AABB, no closer than tmin.
+     */
+    bool intersect_aabb(const aabb& volume, scalar max_distance, scalar& tnear) const
+    {
+        return volume.intersect(origin, inv_dir, sign, tmin, std::min(tmax, max_distance), tnear);
+    }
+};
+
 class Ray {
     public:
 
         vec4 origin;
         vec4 dir;
+        scalar tmin; // Hits closer than this distance along the ray are ignored
+        scalar tmax; // Hits beyond this distance along the ray are ignored
 
-        Ray() = default;
+        /**
+         * Construct a ray accepting hits at any distance in front of its origin.
+         */
+        Ray();
 
-        Ray(vec4 origin, vec4 dir);
+        Ray(vec4 origin, vec4 dir, scalar tmin = 0, scalar tmax = SCALAR_INF);
 
         /**
-         * Test intersection vs an AABB.
+         * Test intersection vs an AABB. Only the part of the volume within [tmin, tmax] along the
+         * ray counts.
          *
-         * @return Distance of the first intersection along the ray. If the distance is negative,
-         * the ray does not intersect.
+         * @return Distance of the first intersection along the ray, no closer than tmin. If the
+         * distance is negative, the ray does not intersect.
          */
         trace_result intersect_aabb(const aabb& volume) const;
 
+        /**
+         * Test intersection vs a single triangle. The ray and triangle must be given in the same
+         * space.
+         *
+         * @param info Closest intersection found so far. Updated if the triangle is hit within
+         * [tmin, tmax] and closer than info.distance. hitobj is left untouched.
+         * @return True if the triangle was hit closer than the previous intersection.
+         */
+        bool intersect_triangle(const Mesh::Triangle& tri, trace_info& info) const;
+
+        /**
+         * Test intersection vs a single triangle, reusing the setup of a watertight test. Rays
+         * passing through a shared edge or vertex always hit at least one of the triangles around
+         * it.
+         *
+         * @param wr This ray, prepared for watertight tests.
+         * @param info Closest intersection found so far. Updated if the triangle is hit within
+         * [tmin, tmax] and closer than info.distance. hitobj is left untouched.
+         * @return True if the triangle was hit closer than the previous intersection.
+         */
+        bool intersect_triangle(const Mesh::Triangle& tri, const watertight_ray& wr,
+                                trace_info& info) const;
+
+        /**
+         * Test intersection vs a packet of triangles at once. Gives the same hits as testing each
+         * triangle with intersect_triangle.
+         *
+         * @param count Number of triangles in use at the start of the packet.
+         * @param mesh Mesh the triangles of the packet belong to.
+         * @param wr This ray, prepared for watertight tests.
+         * @param info Closest intersection found so far. Updated if a triangle is hit within
+         * [tmin, tmax] and closer than info.distance. hitobj is left untouched.
+         * @return True if a triangle was hit closer than the previous intersection.
+         */
+        bool intersect_triangles(const triangle_packet& packet, size_t count, const Mesh& mesh,
+                                 const watertight_ray& wr, trace_info& info) const;
+
+        /**
+         * Test whether a triangle is hit at all within [tmin, tmax]. Cheaper than
+         * intersect_triangle, as no barycentrics or normal are computed.
+         *
+         * @param wr This ray, prepared for watertight tests.
+         */
+        bool intersect_any(const Mesh::Triangle& tri, const watertight_ray& wr) const;
+
+        /**
+         * Test whether any triangle of a packet is hit within [tmin, tmax]. Gives the same answer
+         * as testing each triangle with intersect_any.
+         *
+         * @param count Number of triangles in use at the start of the packet.
+         * @param mesh Mesh the triangles of the packet belong to.
+         * @param wr This ray, prepared for watertight tests.
+         */
+        bool intersect_any(const triangle_packet& packet, size_t count, const Mesh& mesh,
+                           const watertight_ray& wr) const;
+
         /**
          * Test complex intersection vs a MeshInstance. Gives detailed information about the first
          * intersection along the ray. See trace_info for more info.
+         *
+         * @param obj Instance to test against.
+         * @param accel BVH over the triangles of the instanced mesh.
+         * @param max_distance Intersections beyond this distance along the ray are ignored, as
+         * well as those beyond tmax.
+         * @param stats Receives the work done by the trace. May be null.
          */
-        trace_info intersect_mesh(const MeshInstance& obj) const;
+        trace_info intersect_mesh(const MeshInstance& obj, const MeshBVH& accel,
+                                  scalar max_distance, traversal_stats *stats = nullptr) const;
+
+        /**
+         * Test complex intersection vs a MeshInstance, given this ray already transformed into its
+         * object space.
+         *
+         * @param local This ray in the object space of obj.
+         */
+        trace_info intersect_mesh(const MeshInstance& obj, const MeshBVH& accel, const Ray& local,
+                                  scalar max_distance, traversal_stats *stats = nullptr) const;
+
+        /**
+         * Test whether a MeshInstance blocks the ray within [tmin, tmax]. Stops at the first
+         * intersection found, rather than searching for the closest.
+         *
+         * @param obj Instance to test against.
+         * @param accel BVH over the triangles of the instanced mesh.
+         * @param stats Receives the work done by the test. May be null.
+         */
+        bool intersect_any(const MeshInstance& obj, const MeshBVH& accel,
+                           traversal_stats *stats = nullptr) const;
+
+};
+
+/** Largest number of rays in a ray_packet */
+const static size_t RAY_PACKET_SIZE = 16;
+
+/**
+ * Group of coherent rays, such as the primary rays of a small block of the screen, traced through
+ * the BVH together. Each node is fetched and culled once for the whole packet rather than once per
+ * ray.
+ */
+struct ray_packet {
+    Ray rays[RAY_PACKET_SIZE];
+    size_t count; // Number of rays in use at the start of the packet
+
+    ray_packet() : count(0) {}
 
+    /**
+     * Check if the directions of the rays in use agree in sign along every axis. Packets which
+     * don't are too divergent to cull as a whole, and are better traced one ray at a time.
+     */
+    bool coherent() const;
+};
+
+/** Number of object space rays kept by an ObjectRayCache */
+const static size_t OBJECT_RAY_CACHE_SIZE = 4;
+
+/**
+ * Object space copies of a world space ray, kept while the ray is traced so instances sharing a
+ * transform only transform the ray once. Copies are looked up by the transform id of the instance,
+ * and evicted by later ids mapping to the same entry.
+ */
+class ObjectRayCache {
+    private:
+
+        const Ray& m_ray;
+        uint32_t m_ids[OBJECT_RAY_CACHE_SIZE];
+        Ray m_rays[OBJECT_RAY_CACHE_SIZE];
+
+    public:
+
+        /** Id of an empty entry */
+        const static uint32_t NO_TRANSFORM = UINT32_MAX;
+
+        /**
+         * @param r World space ray. Must outlive the cache.
+         */
+        ObjectRayCache(const Ray& r);
+
+        /**
+         * Get the ray in the object space of an instance.
+         *
+         * @param xform_id Id shared only by instances with the same transform as obj.
+         */
+        const Ray& object_ray(const MeshInstance& obj, uint32_t xform_id)
+        {
+            size_t i = xform_id % OBJECT_RAY_CACHE_SIZE;
+            if (m_ids[i] != xform_id) {
+                auto& to_obj = obj.inverse_transform();
+                m_rays[i] = Ray(to_obj * m_ray.origin, to_obj * m_ray.dir, m_ray.tmin, m_ray.tmax);
+                m_ids[i] = xform_id;
+            }
+            return m_rays[i];
+        }
 };
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2018 Matt Monsour
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "wavefront.h"
+#include "aabb.h"
+#include <algorithm>
+
+void ray_queue::clear()
+{
+    origin.clear();
+    dir.clear();
+    tmin.clear();
+    tmax.clear();
+    source.clear();
+}
+
+void ray_queue::push(const Ray& r, uint32_t src)
+{
+    origin.push_back(r.origin);
+    dir.push_back(r.dir);
+    tmin.push_back(r.tmin);
+    tmax.push_back(r.tmax);
+    source.push_back(src);
+}
+
+void ray_queue::gather(const uint32_t *order, size_t first, size_t count, ray_packet& packet) const
+{
+    packet.count = count;
+    for (size_t i = 0; i < count; ++i) {
+        packet.rays[i] = ray(order != nullptr ? order[first + i] : first + i);
+    }
+}
+
+void wavefront_queues::clear()
+{
+    primary.clear();
+    hits.clear();
+    colors.clear();
+    shadow.clear();
+    radiance.clear();
+    owner.clear();
+    blocked.clear();
+}
+
+/**
+ * Fill the order of a stage from its sort keys.
+ */
+static void sort_keys(std::vector<std::pair<uint64_t, uint32_t>>& keys,
+                      std::vector<uint32_t>& order)
+{
+    std::sort(keys.begin(), keys.end());
+    order.resize(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        order[i] = keys[i].second;
+    }
+}
+
+void wavefront_queues::sort_hits()
+{
+    keys.resize(hits.size());
+    for (size_t i = 0; i < hits.size(); ++i) {
+        const MeshInstance *obj = hits[i].intersect_type == IntersectionType::Intersected
+            ? hits[i].hitobj : nullptr;
+        keys[i] = {obj != nullptr ? (uint64_t)(uintptr_t)&obj->mesh() : 0, (uint32_t)i};
+    }
+    sort_keys(keys, order);
+}
+
+void wavefront_queues::bin_shadow_rays()
+{
+    aabb origins = aabb::empty();
+    for (auto& o : shadow.origin) {
+        origins.extend(vec3(o));
+    }
+    aabb directions;
+    directions.min = vec3(-1.0, -1.0, -1.0);
+    directions.max = vec3(1.0, 1.0, 1.0);
+    keys.resize(shadow.size());
+    for (size_t i = 0; i < shadow.size(); ++i) {
+        // Top 32 bits of each code, so the direction decides the bin before the origin does
+        uint64_t dir_code = directions.morton_code(vec3(shadow.dir[i])) >> 31;
+        uint64_t origin_code = origins.morton_code(vec3(shadow.origin[i])) >> 31;
+        keys[i] = {dir_code << 32 | origin_code, (uint32_t)i};
+    }
+    sort_keys(keys, order);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2018 Matt Monsour
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "types.h"
+#include "trace.h"
+#include <glm/vec3.hpp>
+#include <glm/vec4.hpp>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+/**
+ * Queue of rays waiting on the same stage of a wavefront render. Stored in structure of arrays
+ * form, so each stage only streams through the fields it needs.
+ */
+struct ray_queue {
+    std::vector<vec4> origin;
+    std::vector<vec4> dir;
+    std::vector<scalar> tmin;
+    std::vector<scalar> tmax;
+    std::vector<uint32_t> source; // Index of what the ray is traced for, such as a pixel
+
+    size_t size() const { return origin.size(); }
+
+    void clear();
+
+    void push(const Ray& r, uint32_t src);
+
+    Ray ray(size_t i) const { return Ray(origin[i], dir[i], tmin[i], tmax[i]); }
+
+    /**
+     * Gather rays of the queue into a packet.
+     *
+     * @param order Indices of the rays in the order they're traced. If null, rays are taken in
+     * queue order.
+     * @param first Position in the order of the first ray to gather.
+     * @param count Number of rays to gather, no more than RAY_PACKET_SIZE.
+     */
+    void gather(const uint32_t *order, size_t first, size_t count, ray_packet& packet) const;
+};
+
+/**
+ * Queues of a wavefront render. A batch of primary rays is traced in bulk, then shaded with hits
+ * grouped by mesh. Shading records the light arriving at each hit, queueing the shadow rays which
+ * decide it, and those are binned by direction and origin before being traced in bulk as well.
+ * Kept between batches, so the queues are only allocated once.
+ */
+struct wavefront_queues {
+    ray_queue primary; // Source is the index of the pixel each ray samples
+    std::vector<trace_info> hits; // First intersection of each primary ray
+    std::vector<vec3> colors; // Color of each primary ray, once shaded
+    ray_queue shadow; // Source is the index of the light sample each ray decides
+    std::vector<vec3> radiance; // Radiance of each light sample, if not blocked
+    std::vector<uint32_t> owner; // Primary ray each light sample was taken for
+    std::vector<uint8_t> blocked; // Whether each light sample is blocked
+    std::vector<uint32_t> order; // Order rays of the current stage are processed in
+    std::vector<std::pair<uint64_t, uint32_t>> keys; // Sort keys of the current stage
+
+    /**
+     * Empty every queue for the next batch.
+     */
+    void clear();
+
+    /**
+     * Order the primary rays by the mesh they hit, so each mesh is shaded in one run. Rays which
+     * missed come first, and rays hitting the same mesh keep their order.
+     */
+    void sort_hits();
+
+    /**
+     * Order the shadow rays so those with similar directions, then similar origins, are traced
+     * together. Rays are binned along a Morton curve through their directions, and within each
+     * bin along a Morton curve through their origins.
+     */
+    void bin_shadow_rays();
+};
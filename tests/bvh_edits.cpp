@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2018 Matt Monsour
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks that a BVH edited with incremental inserts, removes and moves finds the same closest hits
+ * as testing every triangle of every instance, both while edits are pending and once they are
+ * committed.
+ */
+
+#include "bvh.h"
+#include "scene.h"
+#include "mesh.h"
+#include "trace.h"
+#include "const.h"
+#include <glm/geometric.hpp>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <vector>
+
+/** Number of rounds of edits for each BVH width */
+const static size_t EDIT_ROUNDS = 8;
+/** Number of edits in each round, enough to start background re-optimizations */
+const static size_t EDITS_PER_ROUND = 24;
+/** Number of random rays traced after each round */
+const static size_t RAYS_PER_CHECK = 2000;
+
+struct live_instance {
+    size_t handle;
+    size_t mesh;
+    mat4 xform;
+};
+
+/**
+ * Find the closest hit of a ray by testing every triangle of every instance.
+ */
+static scalar brute_force_distance(const Scene& scene_graph,
+                                   const std::vector<live_instance>& instances, const Ray& r)
+{
+    trace_info closest;
+    closest.intersect_type = IntersectionType::None;
+    closest.distance = r.tmax;
+    for (auto& inst : instances) {
+        mat4 to_obj = glm::inverse(inst.xform);
+        Ray local(to_obj * r.origin, to_obj * r.dir, r.tmin, r.tmax);
+        for (auto& tri : scene_graph.mesh_list()[inst.mesh].triangles()) {
+            local.intersect_triangle(tri, closest);
+        }
+    }
+    return closest.intersect_type == IntersectionType::None ? SCALAR_INF : closest.distance;
+}
+
+static mat4 random_xform(std::mt19937& rng)
+{
+    std::uniform_real_distribution<scalar> pos(-4.0, 4.0), angle(0.0, 6.0), scale(0.5, 1.5);
+    scalar a = angle(rng), s = scale(rng);
+    mat4 xform(MAT4_IDENTITY);
+    xform[0] = vec4(std::cos(a) * s, 0.0, -std::sin(a) * s, 0.0);
+    xform[1] = vec4(0.0, s, 0.0, 0.0);
+    xform[2] = vec4(std::sin(a) * s, 0.0, std::cos(a) * s, 0.0);
+    xform[3] = vec4(pos(rng), pos(rng) * 0.5, pos(rng) - 5.0, 1.0);
+    return xform;
+}
+
+/**
+ * Count the instances placed by a node of the scene graph and its descendants.
+ */
+static size_t count_instances(const aiNode *node)
+{
+    size_t count = node->mNumMeshes;
+    for (size_t i = 0; i < node->mNumChildren; ++i) {
+        count += count_instances(node->mChildren[i]);
+    }
+    return count;
+}
+
+/**
+ * Trace random rays through the BVH, and compare them with the brute force result.
+ *
+ * @return Number of rays which disagree.
+ */
+static size_t check_rays(const Scene& scene_graph, const BVH& bvh,
+                         const std::vector<live_instance>& instances, std::mt19937& rng)
+{
+    std::uniform_real_distribution<scalar> u(-1.0, 1.0);
+    size_t mismatches = 0;
+    for (size_t i = 0; i < RAYS_PER_CHECK; ++i) {
+        vec4 origin(u(rng) * 6.0, u(rng) * 3.0, u(rng) * 6.0 - 4.0, 1.0);
+        vec4 dir = glm::normalize(vec4(u(rng), u(rng), u(rng), 0.0));
+        Ray r(origin, dir);
+        trace_info info = bvh.trace_ray(r);
+        scalar expected = brute_force_distance(scene_graph, instances, r);
+        scalar found = info.hitobj != nullptr ? info.distance : SCALAR_INF;
+        bool same = expected == SCALAR_INF || found == SCALAR_INF ? expected == found
+            : std::abs(expected - found) <= 1e-4 * std::max<scalar>(1.0, expected);
+        if (!same) {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <scene file>" << std::endl;
+        return 2;
+    }
+    std::string file = argv[1];
+    Scene scene_graph(file);
+    if (scene_graph.assimp_scene() == nullptr || scene_graph.mesh_list().empty()) {
+        std::cerr << "Failed to load scene " << file << std::endl;
+        return 2;
+    }
+    size_t mesh_count = scene_graph.mesh_list().size();
+    size_t graph_instances = count_instances(scene_graph.assimp_scene()->mRootNode);
+    int failures = 0;
+    for (size_t width : {2, 4, 8}) {
+        std::mt19937 rng(width);
+        bvh_options opts;
+        opts.width = width;
+        BVH bvh(scene_graph, opts);
+        // Start over from instances placed by the edits alone, so their transforms are known
+        for (size_t handle = 0; handle < graph_instances; ++handle) {
+            bvh.remove_instance(handle);
+        }
+        std::vector<live_instance> instances;
+        for (size_t round = 0; round < EDIT_ROUNDS; ++round) {
+            for (size_t edit = 0; edit < EDITS_PER_ROUND; ++edit) {
+                // Half the edits are inserts, so the tree grows over the rounds
+                size_t choice = instances.empty() ? 0 : rng() % 4;
+                if (choice <= 1) {
+                    size_t mesh = rng() % mesh_count;
+                    mat4 xform = random_xform(rng);
+                    instances.push_back({bvh.insert_instance(mesh, xform), mesh, xform});
+                } else if (choice == 2) {
+                    size_t i = rng() % instances.size();
+                    bvh.remove_instance(instances[i].handle);
+                    instances.erase(instances.begin() + i);
+                } else {
+                    auto& inst = instances[rng() % instances.size()];
+                    inst.xform = random_xform(rng);
+                    bvh.move_instance(inst.handle, inst.xform);
+                }
+            }
+            size_t pending = check_rays(scene_graph, bvh, instances, rng);
+            bvh.commit_edits();
+            size_t committed = check_rays(scene_graph, bvh, instances, rng);
+            std::cout << "width " << width << " round " << round << ": " << instances.size()
+                << " instances, " << pending << " mismatches before commit, " << committed
+                << " after" << std::endl;
+            if (pending != 0 || committed != 0) {
+                failures++;
+            }
+        }
+        bvh.finish_optimization();
+        if (check_rays(scene_graph, bvh, instances, rng) != 0) {
+            std::cout << "width " << width << ": mismatches after re-optimization" << std::endl;
+            failures++;
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2018 Matt Monsour
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Checks that rendering a tile doesn't touch the heap once the per-thread scratch space has been
+ * sized, in each of the ways primary rays can be traced.
+ */
+
+#include "render.h"
+#include "scene.h"
+#include "light.h"
+#include "const.h"
+#include "wavefront.h"
+#include <glm/geometric.hpp>
+#include <glm/trigonometric.hpp>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+static std::atomic<bool> counting(false);
+static std::atomic<size_t> allocations(0);
+
+void *operator new(std::size_t size)
+{
+    if (counting) {
+        ++allocations;
+    }
+    void *p = std::malloc(size > 0 ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <scene file>" << std::endl;
+        return 2;
+    }
+    std::string file = argv[1];
+    Scene scene_graph(file);
+    if (scene_graph.assimp_scene() == nullptr) {
+        std::cerr << "Failed to load scene " << file << std::endl;
+        return 2;
+    }
+    std::vector<std::unique_ptr<Light>> lights;
+    lights.push_back(std::make_unique<DirectionalLight>(vec3(1.0, 1.0, 1.0), 1.0,
+                glm::normalize(vec4(1.0, -1.0, -0.5, 0.0))));
+    Renderer renderer(scene_graph, std::move(lights));
+
+    struct {
+        const char *name;
+        bool packets;
+        bool wavefront;
+    } paths[] = {
+        {"packets", true, false},
+        {"single rays", false, false},
+        {"wavefront", true, true},
+    };
+    int failures = 0;
+    for (auto& path : paths) {
+        for (bool msaa : {false, true}) {
+            render_options opts;
+            opts.width = RENDER_TILE_WIDTH;
+            opts.height = RENDER_TILE_HEIGHT;
+            opts.msaa = msaa;
+            opts.packets = path.packets;
+            opts.wavefront = path.wavefront;
+            size_t msfactor = msaa ? 2 : 1;
+            Camera cam(MAT4_IDENTITY, glm::radians(60.0), (scalar)opts.width / opts.height);
+            RayGenerator rays(cam, opts.width * msfactor, opts.height * msfactor);
+            Framebuffer image(opts.width, opts.height);
+            primary_rays block_rays;
+            wavefront_queues queues;
+            traversal_stats stats;
+            // The first tile sizes the scratch space, and the second should reuse it
+            renderer.render_tile(image, rays, opts, 0, 0, opts.width, opts.height, block_rays,
+                                 queues, &stats);
+            allocations = 0;
+            counting = true;
+            renderer.render_tile(image, rays, opts, 0, 0, opts.width, opts.height, block_rays,
+                                 queues, &stats);
+            counting = false;
+            size_t count = allocations;
+            std::cout << path.name << (msaa ? " (msaa)" : "") << ": " << count
+                << " allocations" << std::endl;
+            if (count != 0) {
+                failures++;
+            }
+        }
+    }
+    return failures == 0 ? 0 : 1;
+}